@@ -72,6 +72,15 @@ it to collect the most common items for the NP08 practical in one place.
  ******************************************************************************/
 
 #include <stdio.h>
+#include <math.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdarg.h>
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define NP08_SSE2
+#define NP08_LOAD4(p) _mm_srai_epi32(_mm_unpacklo_epi16(_mm_loadl_epi64((__m128i*)(p)), _mm_loadl_epi64((__m128i*)(p))), 16)   // Sign extend four int16 samples to int32
+#endif
 
 /* Headers for Windows */
 #ifdef _WIN32
@@ -79,6 +88,14 @@ it to collect the most common items for the NP08 practical in one place.
 #include <conio.h>
 #include "ps5000aApi.h"
 #include <time.h>
+
+// Threads and atomic access for the output writer thread
+typedef HANDLE NP08THREAD;
+#define NP08_THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define NP08_THREAD_START(t, f, a) (((t) = CreateThread(NULL, 0, (f), (a), 0, NULL)) != NULL)
+#define NP08_THREAD_JOIN(t) { WaitForSingleObject((t), INFINITE); CloseHandle(t); }
+#define NP08_LOAD_ACQUIRE(p) InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define NP08_STORE_RELEASE(p, v) InterlockedExchange((volatile LONG *)(p), (v))
 #else
 #include <sys/types.h>
 #include <string.h>
@@ -97,6 +114,15 @@ it to collect the most common items for the NP08 practical in one place.
 #define scanf_s scanf
 #define fscanf_s fscanf
 #define memcpy_s(a,b,c,d) memcpy(a,c,d)
+#define __forceinline inline __attribute__((always_inline))
+
+#include <pthread.h>
+typedef pthread_t NP08THREAD;
+#define NP08_THREAD_FUNC(name, arg) void * name(void * arg)
+#define NP08_THREAD_START(t, f, a) (pthread_create(&(t), NULL, (f), (a)) == 0)
+#define NP08_THREAD_JOIN(t) pthread_join((t), NULL)
+#define NP08_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define NP08_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
 
 typedef enum enBOOL{FALSE,TRUE} BOOL;
 
@@ -254,6 +280,13 @@ int16_t			g_overflow = 0;
 int8_t blockFile[20]  = "block.txt";
 int8_t streamFile[20] = "stream.txt";
 
+// Threshold grid for the streaming threshold scan in streamDataHandler().  Threshold k is at
+// -(streamScanFirst + k * streamScanStep) ADC counts, for k = 0 .. streamScanSteps-1
+#define STREAM_SCAN_MAX_STEPS 1024
+int32_t streamScanFirst = 200;
+int32_t streamScanStep  = 200;
+int32_t streamScanSteps = 160;
+
 typedef struct tBufferInfo
 {
   UNIT * unit;
@@ -721,6 +754,48 @@ void blockDataHandler(UNIT * unit, int8_t * text, int32_t offset, int16_t etsMod
 
 void displaySettings(UNIT* unit, FILE* file);  // Exceptionally this is used before defined, so declare it here.
 
+/****************************************************************************
+* streamScanCount
+* - Used by streamDataHandler for the threshold scan
+* Threshold k is crossed (falling edge) between two samples when
+*   cur < -(streamScanFirst + k*streamScanStep) < prev
+* so the thresholds crossed form one contiguous range of k.  Rather than testing
+* every threshold, add +1 at the start of the range and -1 after the end of it in
+* the difference array diffk[] (streamScanSteps+1 long).  The running sum over
+* diffk[] (see streamScanFold) then gives the number of crossings per threshold.
+****************************************************************************/
+static int32_t streamScanFloorDiv(int32_t a, int32_t b)  // floor(a/b) for b > 0, also for negative a
+{
+  return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+void streamScanCount(int32_t prev, int32_t cur, int32_t * diffk)
+{
+  int32_t kLo, kHi;
+
+  if (cur >= prev || cur >= -streamScanFirst) return;   // Not falling, or not below the first threshold
+
+  kLo = streamScanFloorDiv(-prev - streamScanFirst, streamScanStep) + 1;    // Smallest k with threshold below prev
+  kHi = -streamScanFloorDiv(cur + streamScanFirst, streamScanStep) - 1;     // Largest k with threshold above cur
+  if (kLo < 0) kLo = 0;
+  if (kHi > streamScanSteps - 1) kHi = streamScanSteps - 1;
+  if (kLo > kHi) return;
+
+  diffk[kLo]++;
+  diffk[kHi + 1]--;
+}
+
+// Turn the difference array into the number of crossings for each threshold
+void streamScanFold(int32_t * diffk, int * countk)
+{
+  int32_t k, run = 0;
+
+  for (k = 0; k < streamScanSteps; k++) {
+    run += diffk[k];
+    countk[k] = run;
+  }
+}
+
 /****************************************************************************
 * streamDataHandler
 * - Used by the two stream data examples - untriggered and triggered
@@ -752,8 +827,8 @@ void streamDataHandler(UNIT * unit, uint32_t preTrigger)
   uint32_t numStreamingValues = 0;
   
   int k, ktotal;
-#define STEPS 160
-  int countk[4*STEPS];
+  int countk[PS5000A_MAX_CHANNELS * STREAM_SCAN_MAX_STEPS];
+  int32_t diffk[PS5000A_MAX_CHANNELS][STREAM_SCAN_MAX_STEPS + 1];  // Difference arrays for the threshold scan, see streamScanCount
   
   BUFFER_INFO bufferInfo;
   
@@ -828,7 +903,8 @@ void streamDataHandler(UNIT * unit, uint32_t preTrigger)
   
   fopen_s(&fp, streamFile, "w");
   
-  for (k = 0; k < 4*STEPS; k++) countk[k] = 0;
+  for (k = 0; k < PS5000A_MAX_CHANNELS * STREAM_SCAN_MAX_STEPS; k++) countk[k] = 0;
+  memset(diffk, 0, sizeof(diffk));
   ktotal = 0;
   
   if (fp != NULL) {
@@ -882,9 +958,8 @@ void streamDataHandler(UNIT * unit, uint32_t preTrigger)
 	if (fp != NULL) {
 	  for (j = 0; j < unit->channelCount; j++) {
 	    if (unit->channelSettings[j].enabled) {
-	      for (k = 0; k < STEPS; k++) {    // Thresholds at 200, 400, 600 ... 10000
-		if (appBuffers[j * 2][i] < -200*(k + 1) && appBuffers[j * 2][i - 1] > -200*(k + 1)) countk[k+j*STEPS]++;
-	      }   
+	      // Thresholds at -200, -400, -600 ... by default, see streamScanFirst etc.
+	      streamScanCount(appBuffers[j * 2][i - 1], appBuffers[j * 2][i], diffk[j]);
 	      /* fprintf(	fp,
 		 "Ch%C  %5d = %+5dmV, %5d = %+5dmV   ",
 		 (char)('A' + j),
@@ -908,14 +983,18 @@ void streamDataHandler(UNIT * unit, uint32_t preTrigger)
   
   ps5000aStop(unit->handle);
   
+  for (j = 0; j < unit->channelCount; j++) {
+    streamScanFold(diffk[j], &countk[j * STREAM_SCAN_MAX_STEPS]);
+  }
+
   if (fp != NULL) {
     fprintf(fp, "Index,Thld-ADC,   AThld-mV,ACounts,    BThld-mV, BCounts,    CThld-mV,CCounts,    DThld-mV,DCounts,  No-of-bins,  time-per-bin\n");
-    for (k = 0; k < STEPS; k++) {
-      fprintf(fp, "%5d,%6d,  ", k, (k + 1) * 200);
+    for (k = 0; k < streamScanSteps; k++) {
+      fprintf(fp, "%5d,%6d,  ", k, streamScanFirst + k * streamScanStep);
       for (j = 0; j < unit->channelCount; j++) {
 	int tmv;
-	tmv = adc_to_mv((k + 1) * 200, unit->channelSettings[PS5000A_CHANNEL_A + j].range, unit);
-	fprintf(fp, " %c:,%7d,%7d, ",'A'+j,tmv,countk[k+j*STEPS]);
+	tmv = adc_to_mv(streamScanFirst + k * streamScanStep, unit->channelSettings[PS5000A_CHANNEL_A + j].range, unit);
+	fprintf(fp, " %c:,%7d,%7d, ",'A'+j,tmv,countk[k+j*STREAM_SCAN_MAX_STEPS]);
       }
       fprintf(fp, " %10d, %d,(ns)\n", ktotal, sampleInterval);
     }
@@ -2068,6 +2147,37 @@ void setSignalGenerator(UNIT * unit)
   }
 }
 
+/****************************************************************************
+* setStreamScan
+* Select the threshold grid used by the threshold scan in the streaming
+* collections (see streamDataHandler)
+****************************************************************************/
+void setStreamScan(void)
+{
+  int32_t first, step, steps;
+
+  printf("Threshold scan uses %d thresholds from %d ADC counts in steps of %d (negative going)\n",
+	 streamScanSteps, -streamScanFirst, -streamScanStep);
+
+  do {
+    printf("Specify first threshold as a positive number of ADC counts (e.g. 200): ");
+    fflush(stdin);
+    scanf_s("%d", &first);
+    printf("Specify step between thresholds in ADC counts (e.g. 200): ");
+    fflush(stdin);
+    scanf_s("%d", &step);
+    printf("Specify number of thresholds [1..%d]: ", STREAM_SCAN_MAX_STEPS);
+    fflush(stdin);
+    scanf_s("%d", &steps);
+  } while (first < 0 || step <= 0 || steps < 1 || steps > STREAM_SCAN_MAX_STEPS || first + (steps - 1) * step > 32768);
+
+  streamScanFirst = first;
+  streamScanStep = step;
+  streamScanSteps = steps;
+  printf("Threshold scan set to %d thresholds from %d to %d ADC counts\n",
+	 streamScanSteps, -streamScanFirst, -(streamScanFirst + (streamScanSteps - 1) * streamScanStep));
+}
+
 /****************************************************************************
 * collectStreamingImmediate
 *  This function demonstrates how to collect a stream of data
@@ -2341,7 +2451,7 @@ void PicoscopeMenu(UNIT *unit)
       printf("G - Signal generator\n");
     }
 		
-    printf("D - Set resolution\n");
+    printf("D - Set resolution                            H - Set streaming threshold scan\n");
     printf("                                              P - Return to NP08 main menu\n");
     printf("Operation:");
     
@@ -2369,6 +2479,7 @@ void PicoscopeMenu(UNIT *unit)
     case 'I': setTimebase(unit);               break;
     case 'A': scaleVoltages = !scaleVoltages;  break;
     case 'D': setResolution(unit);             break;
+    case 'H': setStreamScan();                 break;
     case 'P':                                  break;
     default: printf("Invalid operation\n");    break;
     }
@@ -2379,6 +2490,186 @@ void PicoscopeMenu(UNIT *unit)
  This is where the NP08 customisation begins
 ****************************************************************************/
 
+#define NP08_STITCH_DEPTH 8    // Number of records NP08PeakFind5 can hold back waiting for a late decay pulse
+#define NP08_TIMESTAMP_MASK 0x0000FFFFFFFFFFFFULL   // Only the low 48 bits of timeStampCounter are valid
+#define NP08_EX_SLOTS 4        // Extra pulses in the fixed columns of the NP08PeakFind5 record
+#define NP08_EX_MAX 32         // Most extra pulses that can be kept (np08->exKeep)
+
+// One threshold crossing found by NP08ExtractPulses()
+typedef struct NP08Pulse {
+  int index;          // First tick at or beyond threshold
+  int32_t interp;     // Interpolated threshold crossing time in 1/NP08_TIME_FRAC ticks
+  int height;         // Peak amplitude (most negative ADC value)
+  int base;           // Amplitude at base (the highest ADC value in the 20 ticks before)
+  int end;            // First tick back above threshold
+} NP08PULSE;
+
+// One output record of NP08PeakFind5 (see there for the meaning of the fields).  The waveform
+// samples are copied in so the record can be written after the buffers are refilled.
+typedef struct NP08Event {
+  uint32_t group;
+  uint32_t capture;
+  int okall;
+  int ok[4], index[4], height[4], base[4];
+  int32_t interp[4];         // Times in 1/NP08_TIME_FRAC ticks
+  int nex;                   // Extra pulses in slots 1..nex, biggest first by np08->exKey (slot 0 is the preferred one)
+  int ex_ok[NP08_EX_MAX + 1], ex_index[NP08_EX_MAX + 1], ex_height[NP08_EX_MAX + 1], ex_base[NP08_EX_MAX + 1], ex_endindex[NP08_EX_MAX + 1];
+  int32_t ex_interp[NP08_EX_MAX + 1];
+  int ex_hb[NP08_EX_MAX + 1]; // height - base, used to choose the preferred extra pulse (not written out)
+  int16_t wave[4][14];
+  uint64_t tick;             // Trigger time stamp of the capture (timeStampCounter, in samples)
+  int pileOk;                // 1 if pile holds a pulse piled up on the main pulse of the second channel
+  NP08PULSE pile;
+  NP08PULSE pileFirst;       // Then the main pulse itself, with its height once the piled up one is taken off
+  int fitOk[4];              // Template fit of the main pulses (np08->fitLearn), 1 if fitted
+  int fitAmp[4];             // Fitted amplitude in ADC counts below the base
+  int32_t fitTime[4];        // Fitted time in 1/NP08_TIME_FRAC ticks at which the pulse is at half height
+  float fitChi2[4];          // Sum of squared residuals per degree of freedom, in ADC counts squared
+  int qPrompt[4], qTotal[4];       // Charge of the main pulses (np08->chargeTotal), ADC counts x ticks below the base
+  int ex_qPrompt[NP08_EX_MAX + 1], ex_qTotal[NP08_EX_MAX + 1]; // and of the extra pulses
+  float ped[4], rms[4];      // Running pedestal and noise of each channel at this capture (np08->baseMode)
+} NP08EVENT;
+
+#define NP08_UP_TAPS 8         // Samples used for each upsampled value
+#define NP08_UP_SUB 32         // Upsampled values per tick (a multiple of 4)
+#define NP08_FIT_LEN 16        // Ticks in the template fit window (a multiple of 4)
+#define NP08_FIT_PRE 4         // of which this many are before the threshold crossing
+#define NP08_FIT_SUB 16        // Sub-tick steps of the template
+
+// Pulse template of one channel for the template fit, see NP08FitPulse()
+typedef struct NP08Template {
+  float t[NP08_FIT_SUB + 1][NP08_FIT_LEN];   // The template (peak -1) at the window ticks, one row per sub-tick phase
+  float d[NP08_FIT_SUB + 1][NP08_FIT_LEN];   // Its slope per tick
+  float inv[NP08_FIT_SUB + 1][9];            // Inverse of the normal matrix of the fit at each phase
+  double sum[NP08_FIT_LEN * NP08_FIT_SUB + 1];   // While learning: sum and count of the normalised pulses, in sub-tick bins
+  int32_t count[NP08_FIT_LEN * NP08_FIT_SUB + 1];
+  int32_t nLearnt;           // Pulses added so far
+  int32_t ready;             // 1 once the template is made
+} NP08TEMPLATE;
+
+#define NP08_AVG_LEN 48        // Ticks in the averaged pulse shapes (a multiple of 4)
+#define NP08_AVG_PRE 8         // of which this many are before the crossing
+#define NP08_AVG_BASE 4        // The first ticks, whose mean is taken as the baseline of each pulse
+#define NP08_AVG_SUB 4         // Phases of the crossing within a tick, averaged separately
+#define NP08_AVG_CATS 2        // Categories of pulse: 0 = main pulses, 1 = preferred extra pulse (decay)
+
+// Averaged pulse shape of one channel and category, see NP08AverageAdd()
+typedef struct NP08Average {
+  double sum[NP08_AVG_SUB][NP08_AVG_LEN];    // Sum of the samples less the baseline, one row per phase of the crossing
+  double sum2[NP08_AVG_SUB][NP08_AVG_LEN];   // and of their squares
+  uint32_t n[NP08_AVG_SUB];                  // Pulses summed in each row
+} NP08AVERAGE;
+
+#define NP08_MAX_SAMPLES 2500   // Longest capture (see NP08AllocateBuffers)
+#define NP08_MAX_PULSES 1250   // Most crossings possible in the longest capture (2500 samples)
+#define NP08_BATCH 8           // Captures whose pulses are found together, see NP08ExtractBatch()
+#define NP08_BASE_WINDOW 20    // Number of ticks before a crossing looked at for the base
+#define NP08_TIME_FRAC 256     // Interpolated times are integers in 1/256 ticks
+#define NP08_HUNDREDTHS(t) ((((int64_t)(t)) * 100 + NP08_TIME_FRAC / 2) / NP08_TIME_FRAC)   // A time in hundredths of a tick, rounded, for printing
+#define NP08_RATIO(a, b) (NP08Thousandths(a, b) / 1000.)   // Prompt over total charge, for printing
+
+#define NP08_COINC_TEXT 64       // Longest coincidence expression
+#define NP08_COINC_FACTORS 16    // Most channels in a coincidence expression
+#define NP08_COINC_WORDS ((NP08_MAX_SAMPLES + 63) / 64)   // 64 bit words for one bit per tick of a capture
+
+// One channel in the coincidence expression, see NP08CoincCompile()
+typedef struct NP08CoincFactor {
+  int32_t chan;       // Channel, 0 = A
+  int32_t neg;        // 1 = anticoincidence (!)
+  int32_t any;        // 1 = no window given, a pulse anywhere in the capture
+  int32_t d1, d2;     // Window, a pulse from t + d1 to t + d2 ticks, where t is a pulse of the first channel of the term
+  int32_t first;      // 1 if it is the first channel of a term
+} NP08COINCFACTOR;
+
+#define NP08_CUT_TEXT 128        // Longest record cut
+#define NP08_CUT_CODE 64         // Most instructions in a compiled cut
+#define NP08_CUT_STACK 16        // Most values on the stack while a cut is evaluated
+
+// Instructions of a compiled record cut, see NP08CutCompile()
+enum NP08CutCode { NP08_CUT_CONST, NP08_CUT_FIELD, NP08_CUT_NEG, NP08_CUT_NOT, NP08_CUT_ABS, NP08_CUT_MUL, NP08_CUT_DIV, NP08_CUT_ADD, NP08_CUT_SUB,
+		   NP08_CUT_LT, NP08_CUT_LE, NP08_CUT_GT, NP08_CUT_GE, NP08_CUT_EQ, NP08_CUT_NE, NP08_CUT_AND, NP08_CUT_OR, NP08_CUT_PAREN };
+
+typedef struct NP08CutOp {
+  int32_t op;         // NP08_CUT_ code
+  int32_t offset;     // Field: byte offset of the value (an int) in NP08EVENT
+  int32_t okOffset;   // Field: and of the ok flag of its pulse
+  int32_t ped;        // Field: channel whose pedestal is taken off when the pulse is ok (baseMode 2 heights), -1 = none
+  double value;       // Constant: the value.  Field: the scale (1/NP08_TIME_FRAC for times)
+} NP08CUTOP;
+
+#define NP08_WRITE_MAX 64        // Most output buffers of the writer thread
+#define NP08_COL_MAX 400         // Most columns in the columnar file (the longest record has 380)
+#define NP08_COL_ROWS 4096       // Most records in one chunk of it
+
+enum NP08ColumnType { NP08_COL_INT, NP08_COL_TIME, NP08_COL_TENTHS, NP08_COL_RATIO, NP08_COL_WAVE };
+
+// One column of the NP08PeakFind5 record, see NP08ColumnsMake()
+typedef struct NP08Column {
+  char name[16];             // As in the NP08 notebook, flaga1 etc
+  int32_t type;              // NP08_COL_INT int as it is, _TIME interpolated time in hundredths of a tick, _TENTHS float in tenths,
+                             //   _RATIO prompt over total charge in thousandths, _WAVE waveform sample
+  int32_t offset;            // Of the value in NP08EVENT
+  int32_t offset2;           // Of the total charge, for NP08_COL_RATIO
+  int32_t okOffset;          // Of the flag of the pulse, the pedestal is only taken off pulses that are there
+  int32_t ped;               // Channel whose pedestal is taken off (baseMode 2), -1 = none
+} NP08COLUMN;
+
+// The entry of a column in the directory of a chunk of the columnar file
+typedef struct NP08ColumnChunk {
+  int64_t min, max;          // Of the values in the chunk
+  int64_t base;              // Taken off before packing: the minimum, or the least difference
+  int64_t first;             // First value, for the difference encoding
+  uint32_t offset;           // Of the packed values from the start of the chunk
+  uint32_t bytes;            // Length of them
+  uint8_t encoding;          // 0 = value - base for every record, 1 = value - previous value - base from the second record
+  uint8_t width;             // Bits per value, 0 = all the same
+  uint16_t spare1;
+  uint32_t spare2;
+} NP08COLCHUNK;
+
+// One entry of the index of the run file, see NP08IndexGroup()
+typedef struct NP08IndexEntry {
+  uint32_t group;
+  uint32_t part;             // Part of the run file, 0 = runD_XXXXXX.dat, n = runD_XXXXXX_partNNN.dat
+  uint64_t offset;           // Byte in the part where the records written during the group start
+  uint32_t records;          // Number of them
+  uint32_t captures;         // Captures in the group
+  uint64_t tick;             // Trigger time stamp of the first capture in samples, all ones if it was not read (no stitching)
+} NP08INDEXENTRY;
+
+// A flatbuffer being built front to back, see NP08FlatTable()
+typedef struct NP08Flat {
+  uint8_t * buf;
+  int32_t len;               // Bytes used
+  int32_t size;              // Bytes allocated
+  int32_t bad;               // Set if the memory ran out
+} NP08FLAT;
+
+// Where a record batch is in the Arrow file (the Block of the Arrow footer)
+typedef struct NP08ArrowBlock {
+  int64_t offset;            // Of the message from the start of the file
+  int32_t metaLength;        // Of its prefix and metadata
+  int32_t spare;
+  int64_t bodyLength;
+} NP08ARROWBLOCK;
+
+// The writer thread of the output file, see NP08WriterStart()
+typedef struct NP08Writer {
+  FILE * file;               // File written by the thread, NULL = no thread running
+  char * buf[NP08_WRITE_MAX];
+  int32_t len[NP08_WRITE_MAX];    // Bytes in each buffer
+  FILE * dest[NP08_WRITE_MAX];    // File each buffer goes to (they change when the run file moves on to a new part)
+  int32_t nbuf;              // Buffers in use
+  int32_t size;              // Size of each
+  volatile int32_t filled;   // Buffers handed to the thread so far, buffer filled % nbuf is the one being filled
+  volatile int32_t written;  // Buffers the thread has written so far
+  volatile int32_t stop;     // Set when nothing more is coming
+  int32_t flush;             // 1 = fflush after each buffer
+  uint32_t stalls;           // Times the acquisition had to wait with all the buffers full
+  volatile int32_t errors;   // Buffers the thread could not write completely, or parts it could not close
+  NP08THREAD thread;
+} NP08WRITER;
+
 typedef struct NP08Variables {
   // Here are the important run parameters needed in NP08CollectRapidBlock()
   uint32_t nSegments;    // Number of segments desired
@@ -2397,17 +2688,120 @@ typedef struct NP08Variables {
   int16_t trigAuto_ms;          // If zero, no auto trigger, if non-zero, number of ms to look for trigger before triggering
   int16_t trigUseSimple;        // Non-zero means use the simple trigger setup call; 0=use the full one (not debugged)
   uint32_t maxLoopGroups;       // Number of events to collect in loop function
-  uint32_t maxFileSize;         // Maximum file size in loop function
+  uint32_t maxFileSize;         // Size in MB at which the loop function carries on in a new part of the file
   uint32_t vetoB;               // Number of clock ticks around the AB coincidence to avoid looking for the second B
   uint32_t vetoC;               // Number of clock ticks around the AB coincidence to look for the C veto
   uint32_t waveOnOff;           // 1=Write wave info in records, 0 = don't write wave data
   
   int32_t secondChan;        // Channel number to hunt for second peak
   int32_t secondMinDelay;    //  Minimum delay from first peak to consider (was fixed at 50 ticks)
+  int32_t exKeep;            // Number of extra pulses kept on secondChan [1..NP08_EX_MAX], see NP08FindBody()
+  int32_t exKey;             // What they are chosen by, 0 = height - base, 1 = total charge (needs chargeTotal), 2 = earliest
   int32_t writePeakCount;    // (exists, but currently ignored.  Value 0->3 = require peak on this channel to be above np08->writePeakHeight
                              //    Value 11->14 = require the number of channels with peaks to be bigger than this)
   int32_t writePeakHeight;   // Used as threshold on peak to write out (only works if higher than the time threshold, so may be useless)
   int32_t cfdOnOff;          // Enables writing CFD values
+  int32_t stitchWindow;      // Ticks after the trigger in which a pulse in a later capture counts as a decay (0 = off)
+
+  // Shaping filters applied to each channel before peak finding, see NP08FilterCaptures()
+  int32_t filterType[4];     // 0 = off, 1 = moving average, 2 = trapezoid
+  int32_t filterLength[4];   // Moving average length, or rise time k of the trapezoid, in ticks
+  int32_t filterFlat[4];     // Flat top m of the trapezoid in ticks
+  int32_t filterPoleZero[4]; // Decay time M of the pulse tail for the trapezoid pole-zero correction (0 = none)
+
+  // Pile-up search on the main pulse of secondChan, see NP08SplitPileup()
+  int32_t pileDip;           // ADC counts the signal has to recover and fall again by (0 = off)
+  int32_t pileRise;          // Ticks from start to peak of the pulse shape used to separate the two
+  float pileShape[128];      // The shape, filled by NP08PeakFind5 (NP08_PILE_SHAPE long)
+
+  // Template fit of the main pulses, see NP08FitPulse()
+  int32_t fitLearn;          // Number of accepted pulses per channel averaged into the template (0 = off)
+  NP08TEMPLATE fitTemplate[4];
+
+  // Averaged pulse shapes written to a side file instead of the waveforms, see NP08AverageAdd()
+  int32_t avgGroups;         // Groups averaged over before each write (0 = off)
+  NP08AVERAGE avg[NP08_AVG_CATS][4];
+
+  // Output of the run file through a writer thread, see NP08WriterStart()
+  int32_t writeBuffers;      // Number of buffers, 0 = no thread, write as the records come
+  int32_t writeBufKB;        // Size of each buffer in kB
+  int32_t writeFlush;        // 1 = hand the buffer over at the end of every group and flush the file after each buffer, 0 = only full buffers
+  NP08WRITER writer;
+
+  // Index of where each group is in the run file, see NP08IndexGroup()
+  int32_t idxMode;           // 1 = write runD_XXXXXX.idx, 0 = off
+  FILE * idxFile;            // Open by NP08Loop() when idxMode is on, NULL otherwise
+  uint64_t recordCount;      // Records written to the run file by NP08WriteEvent()
+
+  // Running baseline of each channel from the pre-trigger samples, see NP08TrackBaseline()
+  int32_t baseMode;          // 0 = off, 1 = write pedestal and noise, 2 = also thresholds and heights relative to the pedestal
+  double basePed[4];         // Running pedestal in ADC counts
+  double baseRms[4];         // Running noise RMS in ADC counts
+  int32_t baseCount[4];      // Captures in the running values (0 = none yet)
+  int32_t baseReject[4];     // Captures in a row left out as they had a pulse before the trigger
+
+  // Crossing times from the upsampled signal, see NP08UpsampleCross()
+  int32_t upsample;          // 0 = linear interpolation, 1 = cubic, 2 = windowed sinc
+  float upTable[NP08_UP_TAPS][NP08_UP_SUB];   // Weights, filled by NP08PeakFind5
+
+  // Coincidence expression for cut2, see NP08CoincCompile()
+  char coincExpr[NP08_COINC_TEXT];      // As typed in, "" = use writePeakCount instead
+  NP08COINCFACTOR coincFactor[NP08_COINC_FACTORS];
+  int32_t coincCount;                   // Number of factors, 0 = no expression
+  int32_t coincAB;                      // Ticks for the A B coincidence in NP08PeakFind4
+  uint64_t coincMask[4][NP08_COINC_WORDS];   // One bit per tick with a pulse crossing, filled by NP08FindBody()
+
+  // Cut on the record, records failing it are not written, see NP08CutCompile()
+  char cutExpr[NP08_CUT_TEXT];          // As typed in, "" = no cut
+  NP08CUTOP cutCode[NP08_CUT_CODE];
+  int32_t cutCount;                     // Number of instructions, 0 = no cut
+
+  // Pulses found NP08_BATCH captures at a time, see NP08BatchExtract()
+  int32_t batchMode;         // 1 = on (only used when the thresholds are fixed, not with baseMode 2)
+  int32_t batchFirst;        // First capture of the block in batchPulses, -1 = none
+  int32_t batchCount[4][NP08_BATCH];   // Length of each list
+  NP08PULSE * batchPulses;   // The lists, NP08_MAX_PULSES for each channel and capture of the block
+
+  // Captures packed to one byte a sample in 8-bit mode, see NP08PackCaptures()
+  int32_t packMode;          // 1 = pack when the scope is in 8-bit mode, 0 = never
+  int32_t packMask;          // Channels packed in this group, bit j for channel j
+  int8_t *** packBuffers;    // Same layout as rapidBuffers, only allocated while packing, NULL otherwise
+
+  // Zero-suppressed waveforms, the samples around the pulses, to a side file, see NP08WriteZS()
+  int32_t zsMode;            // 1 = on, 0 = off
+  int32_t zsPre;             // Ticks kept before each crossing
+  int32_t zsPost;            // Ticks kept after each pulse ends
+  uint64_t zsMask[NP08_COINC_WORDS];   // One bit per tick to keep, filled by NP08FindBody()
+  FILE * zsFile;             // Open by NP08Loop() when zsMode is on, NULL otherwise
+  uint64_t zsFileSize;       // Bytes written to it
+  NP08WRITER zsWriter;
+
+  // Columnar copy of the records to a side file, see NP08ColumnsMake()
+  int32_t colMode;           // 1 = on, 0 = off
+  NP08COLUMN cols[NP08_COL_MAX];
+  int32_t colCount;          // Columns in the record
+  int64_t * colValues;       // Values of the records of the chunk being filled, NP08_COL_ROWS for each column
+  int32_t colRows;           // Records in it
+  NP08COLCHUNK * colDir;     // Directory of the chunk, one entry for each column
+  uint8_t * colBytes;        // Room for the packed values of one column
+  FILE * colFile;            // Open by NP08Loop() when colMode is on, NULL otherwise
+  uint64_t colFileSize;      // Bytes written to it
+  NP08WRITER colWriter;
+
+  // The same columns as an Arrow IPC (Feather version 2) file, see NP08ArrowBatch()
+  int32_t arrowMode;         // 1 = on, 0 = off
+  FILE * arrowFile;          // Open by NP08Loop() when arrowMode is on, NULL otherwise
+  uint64_t arrowFileSize;    // Bytes written to it, so the offset of the next message
+  NP08FLAT arrowMeta;        // The metadata of the message being written
+  NP08ARROWBLOCK * arrowBlocks;   // The record batches written, for the footer
+  int32_t arrowCount;        // Number of them
+  int32_t arrowSize;         // Room for this many
+  NP08WRITER arrowWriter;
+
+  // Charge integrals of the pulses, see NP08Charge().  Windows in ticks from the crossing
+  int32_t chargeStart;       // Start of both windows
+  int32_t chargePrompt;      // End of the prompt window
+  int32_t chargeTotal;       // End of the total window (0 = no charges)
 
   // Peak finding discriminator thresholds in picoscope defined ADC counts (same as trigThreshold)
   int16_t peakThreshold[4];
@@ -2417,6 +2811,9 @@ typedef struct NP08Variables {
   int16_t *  overflow;
   PS5000A_TRIGGER_INFO * triggerInfo;  // Struct to store trigger timestamping info
   int64_t triggerTimeLast;     // Time stamp index tick value of last capture in last group (may be useful for calculating time gap).
+  NP08EVENT stitchEvents[NP08_STITCH_DEPTH];  // Records held back by the cross-capture stitching (a ring buffer)
+  int32_t stitchFirst;         // Index in stitchEvents[] of the oldest held record
+  int32_t stitchCount;         // Number of held records
   int32_t    isMemAllocated;   // 0 = the above variables point nowhere, 1 = they have been calloc/malloced
 
   // Info from when data are collected
@@ -2428,12 +2825,63 @@ typedef struct NP08Variables {
   PICO_STATUS statusBulk;  // Status from the bulk data transfer
   PICO_STATUS statusTrig;  // Status from the trigger info data transfer
   int32_t  timeIntervalNs; // Filled before data collection when time base set
-  uint32_t currentFileSize; // Current file size for loop function
+  uint64_t currentFileSize; // Size of the current part of the file in the loop function
+  uint64_t runFileSize;     // and of the parts before it
   uint32_t currentLoopGroup; // Current group number in loop function
   int32_t countCut2;      //   At end of 'O' command store the number of output events 9for rate calculation)
   uint32_t runNumber;     // 
+
+  // Health monitor (downsampled streaming, see NP08StreamMonitor())
+  uint32_t monitorDownsample;   // Number of samples aggregated into one min/max bin by the scope
+  uint32_t monitorInterval_s;   // Seconds of data summarised in each line of the monitor file
+
+  // Threshold calibration from the noise, see NP08Calibrate()
+  int32_t calSigma;          // Thresholds proposed this many noise sigma below the pedestal
+  uint32_t calCaptures;      // Auto triggered captures to measure the noise on
 } NP08VARS;
 
+// Frees the packed copies of the captures, if there are any
+void NP08PackFree(UNIT * unit, NP08VARS * np08)
+{
+  int16_t channel;
+  uint32_t capture;
+
+  np08->packMask = 0;
+  if (np08->packBuffers == NULL) return;
+  for (channel = 0; channel < unit->channelCount; channel++) {
+    if (np08->packBuffers[channel] == NULL) continue;
+    for (capture = 0; capture < 1000; capture++) {   // All of them, as allocated by NP08PackAllocate()
+      free(np08->packBuffers[channel][capture]);
+    }
+    free(np08->packBuffers[channel]);
+  }
+  free(np08->packBuffers);
+  np08->packBuffers = NULL;
+}
+
+// Allocates the packed copies of the captures for the enabled channels, returns 0 if there wasn't the memory
+int NP08PackAllocate(UNIT * unit, NP08VARS * np08)
+{
+  int16_t channel;
+  uint32_t capture;
+  uint32_t ncap = 1000;   // The same maximum sizes as np08->rapidBuffers
+  uint32_t nsam = 2500;
+
+  if (np08->packBuffers != NULL) return 1;
+  np08->packBuffers = (int8_t ***)calloc(unit->channelCount, sizeof(int8_t**));
+  if (np08->packBuffers == NULL) return 0;
+  for (channel = 0; channel < unit->channelCount; channel++) {
+    if (!unit->channelSettings[channel].enabled) continue;
+    np08->packBuffers[channel] = (int8_t **)calloc(ncap, sizeof(int8_t*));
+    if (np08->packBuffers[channel] == NULL) { NP08PackFree(unit, np08); return 0; }
+    for (capture = 0; capture < ncap; capture++) {
+      np08->packBuffers[channel][capture] = (int8_t *)malloc(nsam * sizeof(int8_t));
+      if (np08->packBuffers[channel][capture] == NULL) { NP08PackFree(unit, np08); return 0; }
+    }
+  }
+  return 1;
+}
+
 // Allocate memory 
 void NP08AllocateBuffers(UNIT * unit, NP08VARS * np08)
 {
@@ -2463,8 +2911,13 @@ void NP08AllocateBuffers(UNIT * unit, NP08VARS * np08)
     }
   }
 
+  np08->packBuffers = NULL;   // The packed copies come with the first group in 8-bit mode, see NP08PackCaptures()
+  np08->packMask = 0;
+
   // Allocate memory for the trigger timestamping
   np08->triggerInfo = (PS5000A_TRIGGER_INFO *)malloc(ncap * sizeof(PS5000A_TRIGGER_INFO));
+  np08->batchPulses = (NP08PULSE *)malloc(4 * NP08_BATCH * NP08_MAX_PULSES * sizeof(NP08PULSE));
+  np08->batchFirst = -1;
   
   np08->isMemAllocated = 1;
 }
@@ -2496,13 +2949,563 @@ void NP08FreeBuffers(UNIT * unit, NP08VARS * np08)
   }
   
   free(np08->rapidBuffers);
+
+  NP08PackFree(unit, np08);
+
   free(np08->triggerInfo);
+  free(np08->batchPulses);
+  np08->batchFirst = -1;
 
   np08->isMemAllocated = 0;
 }
 
+/****************************************************************************
+* Output writer thread
+*  Writing the run file with fprintf() on the acquisition thread means any
+*  stall of the (network) disk stalls the data taking.  With
+*  np08->writeBuffers set, NP08Loop() starts a thread for the run file and
+*  the records are printed by NP08Printf() into the one of a ring of
+*  np08->writeBuffers buffers of np08->writeBufKB kB that is being filled.
+*  A full buffer, or the partly filled one at the end of each group with
+*  np08->writeFlush, is handed over to the thread, which fwrite()s it.
+*  The ring is a single producer single consumer queue with no lock: the
+*  acquisition only moves wr->filled and the thread only wr->written, each
+*  stored with release and read with acquire ordering, so the contents of
+*  a buffer are complete before the other side sees its count.  The
+*  acquisition only waits when every buffer is still waiting for the disk,
+*  and counts each time in wr->stalls.  np08->currentFileSize counts the
+*  bytes put in the buffers.
+****************************************************************************/
+NP08_THREAD_FUNC(NP08WriterThread, arg)
+{
+  NP08WRITER * wr = (NP08WRITER *)arg;
+  int32_t done = wr->written, b;
+  FILE * last = NULL;
+
+  while (1) {
+    if (NP08_LOAD_ACQUIRE(&wr->filled) != done) {
+      b = done % wr->nbuf;
+      if (last != NULL && wr->dest[b] != last && fclose(last) != 0) wr->errors++;   // The first buffer of a new part, the old part is complete
+      last = wr->dest[b];
+      if (fwrite(wr->buf[b], 1, wr->len[b], last) != (size_t)wr->len[b]) wr->errors++;
+      if (wr->flush) fflush(last);
+      NP08_STORE_RELEASE(&wr->written, ++done);
+    } else if (NP08_LOAD_ACQUIRE(&wr->stop)) {
+      if (NP08_LOAD_ACQUIRE(&wr->filled) == done) {   // Set after the last buffer was handed over, so nothing is left
+	if (last != NULL && last != wr->file && fclose(last) != 0) wr->errors++;   // The old part of a rotation with nothing printed to the new one
+	break;
+      }
+    } else {
+      Sleep(1);
+    }
+  }
+  return 0;
+}
+
+// Hand the buffer being filled to the thread, and wait for the next one to be free if it is still queued
+void NP08WriterHandOver(NP08WRITER * wr)
+{
+  int32_t next = wr->filled + 1;
+
+  NP08_STORE_RELEASE(&wr->filled, next);
+  if (next - NP08_LOAD_ACQUIRE(&wr->written) >= wr->nbuf) {
+    wr->stalls++;
+    while (next - NP08_LOAD_ACQUIRE(&wr->written) >= wr->nbuf) Sleep(1);
+  }
+  wr->len[next % wr->nbuf] = 0;
+  wr->dest[next % wr->nbuf] = wr->file;
+}
+
+// Start the thread of wr writing to file, if np08->writeBuffers is set.  Returns 1 if it is running
+int NP08WriterStart(NP08VARS * np08, NP08WRITER * wr, FILE * file)
+{
+  int32_t b;
+
+  wr->file = NULL;
+  if (np08->writeBuffers <= 0 || file == NULL) return 0;
+  wr->nbuf = (np08->writeBuffers > NP08_WRITE_MAX) ? NP08_WRITE_MAX : np08->writeBuffers;
+  wr->size = ((np08->writeBufKB < 64) ? 64 : np08->writeBufKB) * 1024;   // Room for the longest record many times over
+  for (b = 0; b < wr->nbuf; b++) {
+    wr->buf[b] = (char *)malloc(wr->size);
+    wr->len[b] = 0;
+    wr->dest[b] = file;
+    if (wr->buf[b] == NULL) {
+      printf("Not enough memory for the output buffers, writing directly\n");
+      while (b > 0) free(wr->buf[--b]);
+      return 0;
+    }
+  }
+  wr->filled = 0;
+  wr->written = 0;
+  wr->stop = 0;
+  wr->flush = np08->writeFlush;
+  wr->stalls = 0;
+  wr->errors = 0;
+  wr->file = file;
+  if (!NP08_THREAD_START(wr->thread, NP08WriterThread, wr)) {
+    printf("Could not start the output writer thread, writing directly\n");
+    wr->file = NULL;
+    for (b = 0; b < wr->nbuf; b++) free(wr->buf[b]);
+    return 0;
+  }
+  return 1;
+}
+
+// Hand over what has been printed since the last buffer went
+void NP08WriterFlush(NP08WRITER * wr)
+{
+  if (wr->file != NULL && wr->len[wr->filled % wr->nbuf] > 0) NP08WriterHandOver(wr);
+}
+
+// Carry on the output in newfile instead of file, which is closed once everything printed to it is written (straight away
+// without the thread).  No waiting for the disk: the thread closes it when it gets to the first buffer for newfile, or
+// when it stops
+void NP08WriterRotate(NP08WRITER * wr, FILE * file, FILE * newfile)
+{
+  if (wr->file == NULL) {
+    fclose(file);
+    return;
+  }
+  NP08WriterHandOver(wr);    // Even when empty, so the thread sees the file change
+  wr->file = newfile;
+  wr->dest[wr->filled % wr->nbuf] = newfile;
+}
+
+// 1 if some of the output to file could not be written (the disk is full)
+int NP08WriterFailed(NP08WRITER * wr, FILE * file)
+{
+  if (wr->file == NULL) return ferror(file) != 0;
+  return NP08_LOAD_ACQUIRE(&wr->errors) != 0;
+}
+
+// Write out everything printed and stop the thread.  The file is left open
+void NP08WriterStop(NP08WRITER * wr)
+{
+  int32_t b;
+
+  if (wr->file == NULL) return;
+  NP08WriterFlush(wr);
+  NP08_STORE_RELEASE(&wr->stop, 1);
+  NP08_THREAD_JOIN(wr->thread);
+  for (b = 0; b < wr->nbuf; b++) free(wr->buf[b]);
+  wr->file = NULL;
+  if (wr->stalls > 0) printf("The data taking waited %d times for the output to be written\n", wr->stalls);
+  if (wr->errors > 0) printf("Error: %d output buffers were not written completely, the disk may be full\n", wr->errors);
+}
+
+// fprintf() to file, or into the buffers when it is the file of the writer thread.  Adds the bytes to np08->currentFileSize
+int NP08Printf(NP08VARS * np08, FILE * file, const char * format, ...)
+{
+  NP08WRITER * wr = &np08->writer;
+  va_list ap, aq;
+  int32_t b, n;
+
+  va_start(ap, format);
+  if (wr->file == NULL || file != wr->file) {
+    n = vfprintf(file, format, ap);
+  } else {
+    while (1) {
+      b = wr->filled % wr->nbuf;
+      va_copy(aq, ap);
+      n = vsnprintf(wr->buf[b] + wr->len[b], wr->size - wr->len[b], format, aq);
+      va_end(aq);
+      if (n < 0) break;
+      if (n < wr->size - wr->len[b]) {    // It fitted
+	wr->len[b] += n;
+	break;
+      }
+      if (wr->len[b] == 0) {              // Longer than a whole buffer (can't be, with 64 kB), keep what fitted
+	n = wr->len[b] = wr->size - 1;
+	break;
+      }
+      NP08WriterHandOver(wr);             // Full, try again in the next one
+    }
+  }
+  va_end(ap);
+  if (n > 0) np08->currentFileSize += n;
+  return n;
+}
+
+// fwrite() of n bytes to file, or into the buffers of wr when it is the file of its thread.  Returns the bytes written
+int32_t NP08WriterPut(NP08WRITER * wr, FILE * file, const void * data, int32_t n)
+{
+  const char * p = (const char *)data;
+  int32_t b, m, left = n;
+
+  if (wr->file == NULL || file != wr->file) return (int32_t)fwrite(data, 1, n, file);
+  while (left > 0) {
+    b = wr->filled % wr->nbuf;
+    m = wr->size - wr->len[b];
+    if (m == 0) {
+      NP08WriterHandOver(wr);
+      continue;
+    }
+    if (m > left) m = left;
+    memcpy(wr->buf[b] + wr->len[b], p, m);
+    wr->len[b] += m;
+    p += m;
+    left -= m;
+  }
+  return n;
+}
+
+/****************************************************************************
+* Coincidence engine for the cut2 selection
+*  np08->coincExpr is a coincidence expression, for example
+*    B&A@5&!C@10       a B pulse with an A pulse within 5 ticks and no C
+*                      pulse within 10 ticks (the A&B&!C of NP08PeakFind4)
+*    B&B@50:2500       a B pulse followed by another B 50 to 2500 ticks later
+*    A&B@-3:3|C&D@2    terms joined with | (or)
+*  Each term is channels joined with & (and), each with an optional ! (not)
+*  and an optional window @d (-d to +d ticks) or @d1:d2 (d1 to d2 ticks)
+*  relative to a pulse of the first channel of the term, which can't have a
+*  ! and whose window is ignored.  A channel with no window means a pulse
+*  anywhere in the capture.  NP08CoincCompile() turns it into the list of
+*  factors in np08->coincFactor[].
+*  The pulse finding sets one bit per tick at every crossing in
+*  np08->coincMask[] (1 bit per tick, so 40 words for 2500 ticks).  A
+*  window is then the mask shifted by d1 and ORed with shifted copies of
+*  itself, doubling the width each time, and the term is the mask of the
+*  first channel ANDed (or ANDed NOT) with the window of each of the others.
+*  It is true if any bit is left.  The work is a few whole-word operations
+*  per word per factor, whatever the number of pulses or channels.
+****************************************************************************/
+
+// Parse np08->coincExpr for a scope with nchan channels.  Returns 1 if it is good (np08->coincCount = 0 if it is empty)
+int NP08CoincCompile(NP08VARS * np08, int32_t nchan)
+{
+  const char * s = np08->coincExpr;
+  NP08COINCFACTOR * f;
+  int32_t n = 0, first = 1, d;
+  char * e;
+
+  np08->coincCount = 0;
+  while (*s) {
+    while (*s == ' ') s++;
+    if (n == NP08_COINC_FACTORS) { printf("Coincidence expression has more than %d channels\n", NP08_COINC_FACTORS); return 0; }
+    f = &np08->coincFactor[n];
+    f->first = first;
+    f->neg = 0;
+    if (*s == '!') { f->neg = 1; s++; }
+    f->chan = toupper(*s) - 'A';
+    if (f->chan < 0 || f->chan >= nchan || f->chan >= 4) { printf("Coincidence expression: no channel %c\n", *s ? *s : ' '); return 0; }
+    if (first && f->neg) { printf("Coincidence expression: a term can't start with !\n"); return 0; }
+    s++;
+    f->any = 1;
+    if (*s == '@') {
+      d = strtol(s + 1, &e, 10);
+      if (e == s + 1) { printf("Coincidence expression: no window after @\n"); return 0; }
+      s = e;
+      f->any = 0;
+      if (*s == ':') {
+	f->d1 = d;
+	f->d2 = strtol(s + 1, &e, 10);
+	if (e == s + 1 || f->d2 < f->d1) { printf("Coincidence expression: bad window %d:\n", d); return 0; }
+	s = e;
+      } else {
+	f->d1 = -abs(d);
+	f->d2 = abs(d);
+      }
+    }
+    n++;
+    while (*s == ' ') s++;
+    if (*s == '&') first = 0;
+    else if (*s == '|') first = 1;
+    else if (*s) { printf("Coincidence expression: unexpected %c\n", *s); return 0; }
+    if (*s) {
+      s++;
+      if (!*s) { printf("Coincidence expression ends with an operator\n"); return 0; }
+    }
+  }
+  np08->coincCount = n;
+  return 1;
+}
+
+// dst[t] = src[t + d] on masks of nw words (bits shifted in from outside are 0)
+static __forceinline void NP08MaskShift(uint64_t * dst, const uint64_t * src, int32_t nw, int32_t d)
+{
+  int32_t q = (d >= 0) ? d / 64 : -((-d + 63) / 64), r = d - 64 * q, i, k;   // d = 64 q + r, 0 <= r < 64
+
+  for (i = 0; i < nw; i++) {
+    k = i + q;
+    dst[i] = (k >= 0 && k < nw) ? src[k] >> r : 0;
+    if (r > 0 && k + 1 >= 0 && k + 1 < nw) dst[i] |= src[k + 1] << (64 - r);
+  }
+}
+
+// Sets the bits a to b - 1 of a mask of a n tick capture (the part of them inside it)
+static __forceinline void NP08MaskRange(uint64_t * m, int32_t a, int32_t b, int32_t n)
+{
+  int32_t wa, wb;
+
+  if (a < 0) a = 0;
+  if (b > n) b = n;
+  if (a >= b) return;
+  wa = a >> 6;
+  wb = (b - 1) >> 6;
+  if (wa == wb) {
+    m[wa] |= (~0ULL >> (63 - ((b - 1) & 63))) & (~0ULL << (a & 63));
+    return;
+  }
+  m[wa] |= ~0ULL << (a & 63);
+  while (++wa < wb) m[wa] = ~0ULL;
+  m[wb] |= ~0ULL >> (63 - ((b - 1) & 63));
+}
+
+// Evaluate the compiled expression on the masks of the current capture (n ticks)
+int NP08CoincEval(NP08VARS * np08, int32_t n)
+{
+  uint64_t m[NP08_COINC_WORDS], win[3 * NP08_COINC_WORDS], tmp[3 * NP08_COINC_WORDS], any;
+  NP08COINCFACTOR * f;
+  int32_t nw = (n + 63) / 64, i, k, cov, width, d1, d2, pad, nx, alive = 0;
+
+  for (k = 0; k < np08->coincCount; k++) {
+    f = &np08->coincFactor[k];
+    if (f->first) {
+      if (alive) return 1;    // The term before was true
+      for (i = 0, any = 0; i < nw; i++) any |= m[i] = np08->coincMask[f->chan][i];
+      alive = (any != 0);
+      continue;
+    }
+    if (!alive) continue;     // This term is already false
+    if (f->any) {             // Any pulse at all, the same for all t
+      for (i = 0, any = 0; i < nw; i++) any |= np08->coincMask[f->chan][i];
+      if ((any != 0) == f->neg) alive = 0;
+      continue;
+    }
+    // The window, worked out in a copy of the mask with pad words of zeros each side so nothing is lost off the ends
+    d1 = (f->d1 < -n) ? -n : f->d1;
+    d2 = (f->d2 > n) ? n : f->d2;
+    if (d1 > d2) {            // Nothing can be in the window
+      if (!f->neg) alive = 0;
+      continue;
+    }
+    pad = ((-d1 > d2) ? -d1 : d2);
+    pad = (pad > 0) ? (pad + 63) / 64 : 0;
+    nx = nw + 2 * pad;
+    memset(win, 0, nx * sizeof(uint64_t));
+    memcpy(win + pad, np08->coincMask[f->chan], nw * sizeof(uint64_t));
+    width = d2 - d1 + 1;
+    for (cov = 1; cov < width; cov += cov) {    // win[t] = pulse in t .. t + cov - 1, doubling cov
+      NP08MaskShift(tmp, win, nx, (2 * cov <= width) ? cov : width - cov);
+      for (i = 0; i < nx; i++) win[i] |= tmp[i];
+      if (2 * cov > width) break;
+    }
+    NP08MaskShift(tmp, win, nx, d1);            // tmp[t] = pulse in t + d1 .. t + d2
+    for (i = 0, any = 0; i < nw; i++) {
+      m[i] &= f->neg ? ~tmp[pad + i] : tmp[pad + i];
+      any |= m[i];
+    }
+
+    if (!any) alive = 0;
+  }
+  return alive;
+}
+
+/****************************************************************************
+* Record cut
+*  np08->cutExpr is a C-like expression on the fields of the NP08PeakFind5
+*  record, named as in the NP08 notebook, for example
+*    flaga1&&flagb1&&flagb3&&abs(dtimea1-dtimeb1)<3&&peakb3<-4000
+*  Only records for which it is non-zero are written, so the analysis cuts
+*  can be made while taking data instead of afterwards.  The names are
+*    group capture flagall nex pileflag piledtime1 pilepeak1 piledtime2 pilepeak2
+*    flag time dtime peak base qprompt qtotal fitamp fittime
+*  the second line followed by a channel letter and 1 for the main pulse of
+*  that channel (dtimec1), or by the letter of the second channel and 3, 4,
+*  ... for the extra pulses (peakb3), which also have endtime.  time and
+*  endtime are ticks, dtime and fittime the interpolated times in ticks
+*  (not rounded to hundredths as in the file) and peaks and bases are
+*  relative to the pedestal with baseMode 2, as written.  The operators are
+*  ! - abs() * / + - < <= > >= == != && || with the C precedences, and
+*  brackets.  There is no short cut for && and ||, and x/0 is 0.
+*  NP08CutCompile() parses it once per group into np08->cutCode[], a list of
+*  instructions for a stack machine in reverse Polish order with the fields
+*  already resolved to offsets in NP08EVENT, so NP08CutEval() is one pass
+*  down the list for each record.
+****************************************************************************/
+
+// The fields of a pulse: name, offset of the main pulse value and of the extra pulse value (-1 = none), scale, 1 = relative to the pedestal
+static const struct { const char * name; int32_t main, ex; double scale; int32_t rel; } np08CutFields[] = {
+  { "flag",    offsetof(NP08EVENT, ok),      offsetof(NP08EVENT, ex_ok),       1.,                   0 },
+  { "time",    offsetof(NP08EVENT, index),   offsetof(NP08EVENT, ex_index),    1.,                   0 },
+  { "dtime",   offsetof(NP08EVENT, interp),  offsetof(NP08EVENT, ex_interp),   1. / NP08_TIME_FRAC,  0 },
+  { "peak",    offsetof(NP08EVENT, height),  offsetof(NP08EVENT, ex_height),   1.,                   1 },
+  { "base",    offsetof(NP08EVENT, base),    offsetof(NP08EVENT, ex_base),     1.,                   1 },
+  { "endtime", -1,                           offsetof(NP08EVENT, ex_endindex), 1.,                   0 },
+  { "qprompt", offsetof(NP08EVENT, qPrompt), offsetof(NP08EVENT, ex_qPrompt),  1.,                   0 },
+  { "qtotal",  offsetof(NP08EVENT, qTotal),  offsetof(NP08EVENT, ex_qTotal),   1.,                   0 },
+  { "fitamp",  offsetof(NP08EVENT, fitAmp),  -1,                               1.,                   0 },
+  { "fittime", offsetof(NP08EVENT, fitTime), -1,                               1. / NP08_TIME_FRAC,  0 }
+};
+
+// The binary operators, the two character ones first, and the precedence of each instruction (higher binds tighter)
+static const struct { const char * text; int32_t op; } np08CutOps[] = {
+  { "&&", NP08_CUT_AND }, { "||", NP08_CUT_OR }, { "<=", NP08_CUT_LE }, { ">=", NP08_CUT_GE }, { "==", NP08_CUT_EQ }, { "!=", NP08_CUT_NE },
+  { "<", NP08_CUT_LT }, { ">", NP08_CUT_GT }, { "*", NP08_CUT_MUL }, { "/", NP08_CUT_DIV }, { "+", NP08_CUT_ADD }, { "-", NP08_CUT_SUB }
+};
+static const int32_t np08CutPrec[] = { 9, 9, 6, 6, 6, 5, 5, 4, 4, 3, 3, 3, 3, 2, 2, 1, 0, -1 };
+
+// Turn the field name into c (field, or scalar as "group").  Returns 1 if it is a field
+static int NP08CutField(NP08VARS * np08, const char * name, NP08CUTOP * c)
+{
+  int32_t i, len = (int32_t)strlen(name), d = len, slot, chan;
+
+  c->op = NP08_CUT_FIELD;
+  c->okOffset = offsetof(NP08EVENT, okall);
+  c->ped = -1;
+  c->value = 1.;
+  if (strcmp(name, "group") == 0) { c->offset = offsetof(NP08EVENT, group); return 1; }
+  if (strcmp(name, "capture") == 0) { c->offset = offsetof(NP08EVENT, capture); return 1; }
+  if (strcmp(name, "flagall") == 0) { c->offset = offsetof(NP08EVENT, okall); return 1; }
+  if (strcmp(name, "nex") == 0) { c->offset = offsetof(NP08EVENT, nex); return 1; }
+  if (strcmp(name, "pileflag") == 0) { c->offset = offsetof(NP08EVENT, pileOk); return 1; }
+  if (strcmp(name, "piledtime1") == 0 || strcmp(name, "piledtime2") == 0) {
+    c->offset = (name[9] == '1') ? offsetof(NP08EVENT, pileFirst.interp) : offsetof(NP08EVENT, pile.interp);
+    c->value = 1. / NP08_TIME_FRAC;
+    return 1;
+  }
+  if (strcmp(name, "pilepeak1") == 0 || strcmp(name, "pilepeak2") == 0) {
+    c->offset = (name[8] == '1') ? offsetof(NP08EVENT, pileFirst.height) : offsetof(NP08EVENT, pile.height);
+    c->okOffset = offsetof(NP08EVENT, pileOk);
+    if (np08->baseMode == 2 && np08->secondChan >= 0 && np08->secondChan < 4) c->ped = np08->secondChan;
+    return 1;
+  }
+
+  while (d > 0 && isdigit((unsigned char)name[d - 1])) d--;    // name is <field><letter><number>
+  if (d == len || d < 2) return 0;
+  slot = atoi(name + d);
+  chan = name[d - 1] - 'a';
+  for (i = 0; i < (int32_t)(sizeof(np08CutFields) / sizeof(np08CutFields[0])); i++) {
+    if ((int32_t)strlen(np08CutFields[i].name) != d - 1 || strncmp(name, np08CutFields[i].name, d - 1) != 0) continue;
+    c->value = np08CutFields[i].scale;
+    if (slot == 1 && chan >= 0 && chan < 4 && np08CutFields[i].main >= 0) {   // Main pulse of the channel
+      c->offset = np08CutFields[i].main + chan * sizeof(int);
+      c->okOffset = offsetof(NP08EVENT, ok) + chan * sizeof(int);
+    } else if (slot >= 3 && slot - 3 <= NP08_EX_MAX && chan == np08->secondChan && np08CutFields[i].ex >= 0) {   // Extra pulse
+      c->offset = np08CutFields[i].ex + (slot - 3) * sizeof(int);
+      c->okOffset = offsetof(NP08EVENT, ex_ok) + (slot - 3) * sizeof(int);
+    } else {
+      return 0;
+    }
+    if (np08CutFields[i].rel && np08->baseMode == 2) c->ped = chan;
+    return 1;
+  }
+  return 0;
+}
+
+// Parse np08->cutExpr into np08->cutCode[].  Returns 1 if it is good (np08->cutCount = 0 if it is empty)
+int NP08CutCompile(NP08VARS * np08)
+{
+  const char * s = np08->cutExpr;
+  char name[NP08_CUT_TEXT], * e;
+  int32_t stack[NP08_CUT_CODE];    // Operators waiting for their right hand side, and open brackets
+  int32_t nst = 0, n = 0, depth = 0, operand = 1, i, k, op;
+
+  np08->cutCount = 0;
+  while (1) {
+    while (*s == ' ') s++;
+    if (n + nst >= NP08_CUT_CODE) { printf("Cut has more than %d terms\n", NP08_CUT_CODE); return 0; }   // Each term moves from the stack to the code at most once
+    if (operand) {    // A value next: a number, a field or a bracket, after any unary operators
+      if (*s == '(') { stack[nst++] = NP08_CUT_PAREN; s++; continue; }
+      if (*s == '-') { stack[nst++] = NP08_CUT_NEG; s++; continue; }
+      if (*s == '!') { stack[nst++] = NP08_CUT_NOT; s++; continue; }
+      if (isdigit((unsigned char)*s) || *s == '.') {
+	np08->cutCode[n].op = NP08_CUT_CONST;
+	np08->cutCode[n++].value = strtod(s, &e);
+	s = e;
+      } else if (isalpha((unsigned char)*s)) {
+	for (k = 0; isalnum((unsigned char)*s); s++) name[k++] = (char)tolower(*s);
+	name[k] = '\0';
+	if (strcmp(name, "abs") == 0) {
+	  while (*s == ' ') s++;
+	  if (*s != '(') { printf("Cut: abs needs a bracket\n"); return 0; }
+	  stack[nst++] = NP08_CUT_ABS;
+	  continue;
+	}
+	if (!NP08CutField(np08, name, &np08->cutCode[n++])) { printf("Cut: no field %s\n", name); return 0; }
+      } else {
+	if (*s == '\0' && n == 0 && nst == 0) return 1;    // Empty, no cut
+	printf("Cut: expected a value at %s\n", *s ? s : "the end");
+	return 0;
+      }
+      if (++depth > NP08_CUT_STACK) { printf("Cut is nested too deep\n"); return 0; }
+      operand = 0;
+      continue;
+    }
+
+    // An operator, a closing bracket or the end next.  First out go the operators on the stack that bind tighter
+    op = -1;
+    if (*s == ')' || *s == '\0') {
+      op = NP08_CUT_PAREN;
+    } else {
+      for (i = 0; i < (int32_t)(sizeof(np08CutOps) / sizeof(np08CutOps[0])); i++) {
+	if (strncmp(s, np08CutOps[i].text, strlen(np08CutOps[i].text)) == 0) { op = np08CutOps[i].op; break; }
+      }
+      if (op < 0) { printf("Cut: unexpected %s\n", s); return 0; }
+    }
+    while (nst > 0 && stack[nst - 1] != NP08_CUT_PAREN && np08CutPrec[stack[nst - 1]] >= np08CutPrec[op]) {
+      np08->cutCode[n++].op = stack[--nst];
+      if (np08->cutCode[n - 1].op >= NP08_CUT_MUL) depth--;    // A binary one takes two values and leaves one
+    }
+    if (*s == '\0') {
+      if (nst > 0) { printf("Cut: missing )\n"); return 0; }
+      break;
+    }
+    if (op == NP08_CUT_PAREN) {
+      if (nst == 0) { printf("Cut: too many )\n"); return 0; }
+      if (stack[--nst] != NP08_CUT_PAREN) { printf("Cut: missing (\n"); return 0; }
+      s++;
+      continue;
+    }
+    stack[nst++] = op;
+    s += strlen(np08CutOps[i].text);
+    operand = 1;
+  }
+  np08->cutCount = n;
+  return 1;
+}
+
+// Evaluate the compiled cut on a record.  Returns 1 if it passes
+int NP08CutEval(NP08VARS * np08, const NP08EVENT * ev)
+{
+  double v[NP08_CUT_STACK];
+  const NP08CUTOP * c;
+  int32_t i, k = -1, x;
+
+  for (i = 0; i < np08->cutCount; i++) {
+    c = &np08->cutCode[i];
+    switch (c->op) {
+    case NP08_CUT_CONST: v[++k] = c->value; break;
+    case NP08_CUT_FIELD:
+      x = *(const int32_t *)((const char *)ev + c->offset);
+      if (c->ped >= 0 && *(const int32_t *)((const char *)ev + c->okOffset)) x -= (int32_t)lrintf(ev->ped[c->ped]);
+      v[++k] = x * c->value;
+      break;
+    case NP08_CUT_NEG: v[k] = -v[k]; break;
+    case NP08_CUT_NOT: v[k] = (v[k] == 0.); break;
+    case NP08_CUT_ABS: v[k] = fabs(v[k]); break;
+    case NP08_CUT_MUL: k--; v[k] *= v[k + 1]; break;
+    case NP08_CUT_DIV: k--; v[k] = (v[k + 1] != 0.) ? v[k] / v[k + 1] : 0.; break;
+    case NP08_CUT_ADD: k--; v[k] += v[k + 1]; break;
+    case NP08_CUT_SUB: k--; v[k] -= v[k + 1]; break;
+    case NP08_CUT_LT: k--; v[k] = (v[k] < v[k + 1]); break;
+    case NP08_CUT_LE: k--; v[k] = (v[k] <= v[k + 1]); break;
+    case NP08_CUT_GT: k--; v[k] = (v[k] > v[k + 1]); break;
+    case NP08_CUT_GE: k--; v[k] = (v[k] >= v[k + 1]); break;
+    case NP08_CUT_EQ: k--; v[k] = (v[k] == v[k + 1]); break;
+    case NP08_CUT_NE: k--; v[k] = (v[k] != v[k + 1]); break;
+    case NP08_CUT_AND: k--; v[k] = (v[k] != 0. && v[k + 1] != 0.); break;
+    case NP08_CUT_OR: k--; v[k] = (v[k] != 0. || v[k + 1] != 0.); break;
+    }
+  }
+  return (k < 0 || v[0] != 0.);
+}
+
 void setNP08Default(UNIT* unit, NP08VARS* np08)
 {
+  int i;
+
   // Currently these are the values from the example collectRapidBlock, eventually we want to make nSamples stretch 10us
   np08->nSegments = 4000;    // Number of segments desired
   np08->nCaptures = 1000;    // Number of captures desired, must be less than nSegments/#active channels
@@ -2518,7 +3521,13 @@ void setNP08Default(UNIT* unit, NP08VARS* np08)
   np08->trigAuto_ms = 1000;   // Set >0 for an auto mode scope (number is the number of ms to wait)
   np08->trigUseSimple = 1; // Non-zero means o use the simplified trigger setup
   np08->maxLoopGroups = 3600000;
-  np08->maxFileSize = 1000;  // In units of MB
+  np08->maxFileSize = 1000;  // In units of MB, for each part of the run file
+  np08->writeBuffers = 8;    // Output through a writer thread, 8 buffers of 1 MB written every group
+  np08->writeBufKB = 1024;
+  np08->writeFlush = 1;
+  np08->writer.file = NULL;
+  np08->idxMode = 1;         // Index of the run file on
+  np08->idxFile = NULL;
   np08->vetoB = 30;
   np08->vetoC = 10;
   np08->waveOnOff = 0;   // 0=off, 1 = on
@@ -2526,10 +3535,62 @@ void setNP08Default(UNIT* unit, NP08VARS* np08)
 
   np08->secondChan = 1;      // Channel B:   Channel number to hunt for second peak
   np08->secondMinDelay = 50; // Minimum delay from first peak to consider (was fixed at 50 ticks)
+  np08->exKeep = 4;          // The four that always fitted in the record
+  np08->exKey = 0;           // Biggest height - base
   np08->writePeakCount = 0;  // (exists, but currently ignored.  Value 0->3 = require peak on this channel to be above np08->writePeakHeight
                              //   Value 11->14 = require the number of channels with peaks to be bigger than this)
   np08->writePeakHeight = -2000;  // Used as threshold on peak to write out (only works if higher than the time threshold, so may be useless)
   np08->cfdOnOff = 0;        // Enables writing CFD values
+  np08->stitchWindow = 0;    // Cross-capture decay stitching off
+  for (i = 0; i < 4; i++) {
+    np08->filterType[i] = 0;       // No filters
+    np08->filterLength[i] = 4;
+    np08->filterFlat[i] = 2;
+    np08->filterPoleZero[i] = 0;
+  }
+  np08->pileDip = 0;         // Pile-up search off
+  np08->pileRise = 3;
+  np08->fitLearn = 0;        // Template fit off
+  memset(np08->fitTemplate, 0, sizeof(np08->fitTemplate));
+  np08->avgGroups = 0;       // Averaged pulse shapes off
+  memset(np08->avg, 0, sizeof(np08->avg));
+  np08->chargeStart = -4;
+  np08->chargePrompt = 12;
+  np08->chargeTotal = 0;     // Charges off
+  np08->coincExpr[0] = '\0'; // Cut2 from writePeakCount
+  np08->cutExpr[0] = '\0';   // No record cut
+  np08->cutCount = 0;
+  np08->coincCount = 0;
+  np08->coincAB = 5;
+  np08->batchMode = 1;
+  np08->batchFirst = -1;
+  np08->packMode = 1;
+  np08->packMask = 0;
+  np08->zsMode = 0;          // Zero-suppressed waveforms off
+  np08->zsPre = 16;
+  np08->zsPost = 32;
+  np08->zsFile = NULL;
+  np08->zsWriter.file = NULL;
+  np08->colMode = 0;         // Columnar file off
+  np08->colFile = NULL;
+  np08->colValues = NULL;
+  np08->colWriter.file = NULL;
+  np08->arrowMode = 0;       // Arrow file off
+  np08->arrowFile = NULL;
+  np08->arrowWriter.file = NULL;
+  np08->upsample = 0;        // Linear interpolation
+  np08->baseMode = 0;        // Baseline tracking off
+  for (i = 0; i < 4; i++) {
+    np08->basePed[i] = 0.;
+    np08->baseRms[i] = 0.;
+    np08->baseCount[i] = 0;
+    np08->baseReject[i] = 0;
+  }
+
+  np08->monitorDownsample = 256;  // 256 x 8ns = 2us bins
+  np08->monitorInterval_s = 60;   // One line per minute
+  np08->calSigma = 5;
+  np08->calCaptures = 100;
 }
 
 void printNP08Things(UNIT* unit, NP08VARS* np08, FILE * file) {
@@ -2571,8 +3632,111 @@ void printNP08Things(UNIT* unit, NP08VARS* np08, FILE * file) {
   } else {
 	  fprintf(file, " M Cut2 selection when at least %d channels active\n", np08->writePeakCount-10);
   }
+  if (np08->coincExpr[0]) {
+    fprintf(file, " G Cut2 coincidence %s (instead of M)\n", np08->coincExpr);
+  } else {
+    fprintf(file, " G Cut2 coincidence off\n");
+  }
+  if (np08->cutExpr[0]) {
+    fprintf(file, " J Record cut %s\n", np08->cutExpr);
+  } else {
+    fprintf(file, " J Record cut off\n");
+  }
+  switch (np08->exKey) {
+  case 1: fprintf(file, " H Extra pulses on second channel, keep the %d with the biggest total charge%s\n", np08->exKeep,
+		  (np08->chargeTotal > 0) ? "" : " (charges off, height - base)"); break;
+  case 2: fprintf(file, " H Extra pulses on second channel, keep the %d earliest\n", np08->exKeep); break;
+  default: fprintf(file, " H Extra pulses on second channel, keep the %d with the biggest height - base\n", np08->exKeep); break;
+  }
+  if (np08->stitchWindow > 0) {
+    fprintf(file, " W Decay search in later captures up to %d ticks after trigger\n", np08->stitchWindow);
+  } else {
+    fprintf(file, " W Decay search in later captures off\n");
+  }
+  if (np08->pileDip > 0) {
+    fprintf(file, " U Pile-up search on second channel, dip %d ADC counts, pulse rise %d ticks\n", np08->pileDip, np08->pileRise);
+  } else {
+    fprintf(file, " U Pile-up search on second channel off\n");
+  }
+  if (np08->fitLearn > 0) {
+    fprintf(file, " R Template fit of main pulses, template from %d pulses (learnt:", np08->fitLearn);
+    for (ch = 0; ch < unit->channelCount && ch < 4; ch++) fprintf(file, " %c %d", ch + 'A', np08->fitTemplate[(unsigned char)ch].nLearnt);
+    fprintf(file, ")\n");
+  } else {
+    fprintf(file, " R Template fit of main pulses off\n");
+  }
+  if (np08->avgGroups > 0) {
+    fprintf(file, " Y Averaged pulse shapes written every %d groups\n", np08->avgGroups);
+  } else {
+    fprintf(file, " Y Averaged pulse shapes off\n");
+  }
+  if (np08->writeBuffers > 0) {
+    fprintf(file, " O Output through a writer thread, %d buffers of %d kB, %s, new file every %d MB\n", np08->writeBuffers, np08->writeBufKB,
+	    np08->writeFlush ? "written every group" : "written when full", np08->maxFileSize);
+  } else {
+    fprintf(file, " O Output written directly, no writer thread, new file every %d MB\n", np08->maxFileSize);
+  }
+  if (np08->idxMode) {
+    fprintf(file, "   Index of the groups in the run file (extra menu I)\n");
+  }
+  if (np08->zsMode) {
+    fprintf(file, "   Zero-suppressed waveforms, %d ticks before and %d after each pulse (extra menu Z)\n", np08->zsPre, np08->zsPost);
+  }
+  if (np08->colMode) {
+    fprintf(file, "   Columnar copy of the records (extra menu F)\n");
+  }
+  if (np08->arrowMode) {
+    fprintf(file, "   Arrow (Feather) copy of the records (extra menu A)\n");
+  }
+  if (np08->chargeTotal > 0) {
+    fprintf(file, " Q Charges from crossing %+d ticks, prompt to %+d, total to %+d\n", np08->chargeStart, np08->chargePrompt, np08->chargeTotal);
+  } else {
+    fprintf(file, " Q Charges off\n");
+  }
+  switch (np08->upsample) {
+  case 1: fprintf(file, " I Crossing times from cubic upsampling\n"); break;
+  case 2: fprintf(file, " I Crossing times from windowed sinc upsampling\n"); break;
+  default: fprintf(file, " I Crossing times from linear interpolation\n"); break;
+  }
+  switch (np08->baseMode) {
+  case 1: fprintf(file, " V Baseline tracking on, pedestal and noise written"); break;
+  case 2: fprintf(file, " V Baseline tracking on, peak thresholds and heights relative to the pedestal"); break;
+  default: fprintf(file, " V Baseline tracking off"); break;
+  }
+  for (ch = 0; ch < unit->channelCount && ch < 4; ch++) {
+    if (np08->baseMode != 0 && np08->baseCount[(unsigned char)ch] > 0) fprintf(file, "%s %c %.1f+-%.1f", (ch == 0) ? ":" : ",", ch + 'A', np08->basePed[(unsigned char)ch], np08->baseRms[(unsigned char)ch]);
+  }
+  fprintf(file, "\n");
+  fprintf(file, " F Filters:");
+  for (ch = 0; ch < unit->channelCount && ch < 4; ch++) {
+    switch (np08->filterType[(unsigned char)ch]) {
+    case 1: fprintf(file, " %c moving average %d", ch + 'A', np08->filterLength[(unsigned char)ch]); break;
+    case 2: fprintf(file, " %c trapezoid k=%d m=%d M=%d", ch + 'A', np08->filterLength[(unsigned char)ch], np08->filterFlat[(unsigned char)ch], np08->filterPoleZero[(unsigned char)ch]); break;
+    default: fprintf(file, " %c off", ch + 'A'); break;
+    }
+    if (ch < unit->channelCount - 1 && ch < 3) fprintf(file, ",");
+  }
+  fprintf(file, "\n");
 }
 
+// Reads one word of at most size - 1 characters into text, returns 0 and leaves text empty if it was longer
+int NP08ReadWord(char * text, int size) {
+  char format[16];
+  int c;
+
+  snprintf(format, sizeof(format), "%%%ds", size - 1);
+  if (scanf(format, text) != 1) {
+    text[0] = '\0';
+    return 0;
+  }
+  c = getchar();
+  if (c != EOF && !isspace(c)) {
+    while (c != EOF && c != '\n') c = getchar();
+    text[0] = '\0';
+    return 0;
+  }
+  return 1;
+}
 
 void setNP08Things(UNIT * unit, NP08VARS * np08) {
   int32_t retry;
@@ -2708,31 +3872,209 @@ void setNP08Things(UNIT * unit, NP08VARS * np08) {
 		} while (ch == '\0');
 	    break;
 
-#if 0
-    case 'M':
-		printf("Criterion for cut 2 to write to file\n");
+    case 'F':
+      printf("Select the channel to filter A,B,C,D:");
       fflush(stdin);
-      scanf_s("%lud", &np08->writePeakCount);
-      printf("Require %d channels to have at least one peak to write capture to file\n", np08->writePeakCount);
+      ch = toupper(_getch());
+      printf("\n");
+      i = ch - 'A';
+      if (i < 0 || i >= unit->channelCount || i >= 4) break;
+      do {
+	printf("Filter for channel %c, 0 = off, 1 = moving average, 2 = trapezoidal shaper:", i + 'A');
+	fflush(stdin);
+	scanf_s("%d", &np08->filterType[i]);
+      } while (np08->filterType[i] < 0 || np08->filterType[i] > 2);
+      if (np08->filterType[i] == 1) {
+	do {
+	  printf("Give moving average length in ticks [1..64]:");
+	  fflush(stdin);
+	  scanf_s("%d", &np08->filterLength[i]);
+	} while (np08->filterLength[i] < 1 || np08->filterLength[i] > 64);
+      } else if (np08->filterType[i] == 2) {
+	do {
+	  printf("Give trapezoid rise time k in ticks [1..32]:");
+	  fflush(stdin);
+	  scanf_s("%d", &np08->filterLength[i]);
+	} while (np08->filterLength[i] < 1 || np08->filterLength[i] > 32);
+	do {
+	  printf("Give trapezoid flat top m in ticks [0..32]:");
+	  fflush(stdin);
+	  scanf_s("%d", &np08->filterFlat[i]);
+	} while (np08->filterFlat[i] < 0 || np08->filterFlat[i] > 32);
+	do {
+	  printf("Give pulse decay time M in ticks for pole-zero correction (0 = none) [0..255]:");
+	  fflush(stdin);
+	  scanf_s("%d", &np08->filterPoleZero[i]);
+	} while (np08->filterPoleZero[i] < 0 || np08->filterPoleZero[i] > 255);
+      }
       break;
-#endif
 
-    case 'Z':
-      printf("Reset all parameters\n");
-      setNP08Default(unit, np08);
+    case 'U':
+      do {
+	printf("Give the dip in ADC counts between two piled up pulses on the second channel (0 = off) [0..32767]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->pileDip);
+      } while (np08->pileDip < 0 || np08->pileDip > 32767);
+      if (np08->pileDip == 0) break;
+      do {
+	printf("Give the ticks from start to peak of a pulse [1..16]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->pileRise);
+      } while (np08->pileRise < 1 || np08->pileRise > 16);
       break;
-      
-    case 'X':
-      return;
-      
-    default:
+
+    case 'R':
+      do {
+	printf("Give the number of accepted pulses per channel to average into the template, the\n");
+	printf("template is learnt again from the next ones (0 = no template fit) [0..1000000]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->fitLearn);
+      } while (np08->fitLearn < 0 || np08->fitLearn > 1000000);
+      memset(np08->fitTemplate, 0, sizeof(np08->fitTemplate));
       break;
-    }  // End Switch
-  } while (1); // End do
-}
 
-void setNP08Expert(UNIT * unit, NP08VARS * np08) {
-  char ch = 'X';
+    case 'Y':
+      do {
+	printf("Give the number of groups to average the pulse shapes over before writing them to\n");
+	printf("runD_XXXXXX_avg.dat (0 = off) [0..1000000]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->avgGroups);
+      } while (np08->avgGroups < 0 || np08->avgGroups > 1000000);
+      memset(np08->avg, 0, sizeof(np08->avg));
+      break;
+
+    case 'O':
+      do {
+	printf("Give the size in MB at which a long run carries on in a new file, runD_XXXXXX_partNNN.dat [1..1000000]:");
+	fflush(stdin);
+	scanf_s("%u", &np08->maxFileSize);
+      } while (np08->maxFileSize < 1 || np08->maxFileSize > 1000000);
+      do {
+	printf("Give the number of output buffers for the writer thread (0 = no thread, write directly) [0..%d]:", NP08_WRITE_MAX);
+	fflush(stdin);
+	scanf_s("%d", &np08->writeBuffers);
+      } while (np08->writeBuffers < 0 || np08->writeBuffers > NP08_WRITE_MAX);
+      if (np08->writeBuffers == 0) break;
+      do {
+	printf("Give the size of each buffer in kB [64..65536]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->writeBufKB);
+      } while (np08->writeBufKB < 64 || np08->writeBufKB > 65536);
+      do {
+	printf("Write the buffers 0 = only when full, 1 = also at the end of every group (and flush the file):");
+	fflush(stdin);
+	scanf_s("%d", &np08->writeFlush);
+      } while (np08->writeFlush < 0 || np08->writeFlush > 1);
+      break;
+
+    case 'G':
+      printf("Coincidence for cut2, e.g. B&A@5&!C@10 (B with A within 5 ticks and no C within 10),\n");
+      printf("B&B@50:2500 (a second B 50 to 2500 ticks after), A&B|C&D (either), no spaces, - for off:");
+      fflush(stdin);
+      if (!NP08ReadWord(np08->coincExpr, NP08_COINC_TEXT)) printf("Longer than %d characters, coincidence off\n", NP08_COINC_TEXT - 1);
+      if (strcmp(np08->coincExpr, "-") == 0) np08->coincExpr[0] = '\0';
+      if (!NP08CoincCompile(np08, unit->channelCount)) np08->coincExpr[0] = '\0';
+      break;
+
+    case 'J':
+      printf("Cut on the record, written only if true, e.g. flaga1&&flagb3&&abs(dtimea1-dtimeb1)<3&&peakb3<-4000\n");
+      printf("(names as in the notebook, dtime in ticks, operators as in C and abs()), no spaces, - for off:");
+      fflush(stdin);
+      if (!NP08ReadWord(np08->cutExpr, NP08_CUT_TEXT)) printf("Longer than %d characters, cut off\n", NP08_CUT_TEXT - 1);
+      if (strcmp(np08->cutExpr, "-") == 0) np08->cutExpr[0] = '\0';
+      if (!NP08CutCompile(np08)) np08->cutExpr[0] = '\0';
+      break;
+
+    case 'H':
+      do {
+	printf("Give the number of extra pulses to keep on the second channel, the first %d are in the\n", NP08_EX_SLOTS);
+	printf("usual columns and the others at the end of the record [1..%d]:", NP08_EX_MAX);
+	fflush(stdin);
+	scanf_s("%d", &np08->exKeep);
+      } while (np08->exKeep < 1 || np08->exKeep > NP08_EX_MAX);
+      do {
+	printf("Keep them by 0 = biggest height - base, 1 = biggest total charge (set Q first), 2 = earliest:");
+	fflush(stdin);
+	scanf_s("%d", &np08->exKey);
+      } while (np08->exKey < 0 || np08->exKey > 2 || (np08->exKey == 1 && np08->chargeTotal == 0));
+      break;
+
+    case 'I':
+      do {
+	printf("Crossing times from 0 = linear interpolation, 1 = cubic upsampling, 2 = windowed sinc upsampling:");
+	fflush(stdin);
+	scanf_s("%d", &np08->upsample);
+      } while (np08->upsample < 0 || np08->upsample > 2);
+      break;
+
+    case 'V':
+      do {
+	printf("Baseline tracking from the pre-trigger samples, 0 = off, 1 = write pedestal and noise,\n");
+	printf("2 = also make peak thresholds and heights relative to the pedestal:");
+	fflush(stdin);
+	scanf_s("%d", &np08->baseMode);
+      } while (np08->baseMode < 0 || np08->baseMode > 2);
+      for (i = 0; i < 4; i++) {    // Start again
+	np08->basePed[i] = 0.;
+	np08->baseRms[i] = 0.;
+	np08->baseCount[i] = 0;
+	np08->baseReject[i] = 0;
+      }
+      break;
+
+    case 'Q':
+      do {
+	printf("Give the end of the total charge window in ticks after the crossing (0 = no charges) [0..2000]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->chargeTotal);
+      } while (np08->chargeTotal < 0 || np08->chargeTotal > 2000);
+      if (np08->chargeTotal == 0) break;
+      do {
+	printf("Give the start of the windows in ticks from the crossing [-64..%d]:", np08->chargeTotal - 1);
+	fflush(stdin);
+	scanf_s("%d", &np08->chargeStart);
+      } while (np08->chargeStart < -64 || np08->chargeStart >= np08->chargeTotal);
+      do {
+	printf("Give the end of the prompt window in ticks from the crossing [%d..%d]:", np08->chargeStart + 1, np08->chargeTotal);
+	fflush(stdin);
+	scanf_s("%d", &np08->chargePrompt);
+      } while (np08->chargePrompt <= np08->chargeStart || np08->chargePrompt > np08->chargeTotal);
+      break;
+
+    case 'W':
+      do {
+	printf("Give the time window in ticks after the trigger to look for a decay pulse in the\n");
+	printf("following captures (e.g. 2500 for 20us with 8ns ticks, 0 = off) [0..1000000]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->stitchWindow);
+      } while (np08->stitchWindow < 0 || np08->stitchWindow > 1000000);
+      break;
+
+#if 0
+    case 'M':
+		printf("Criterion for cut 2 to write to file\n");
+      fflush(stdin);
+      scanf_s("%lud", &np08->writePeakCount);
+      printf("Require %d channels to have at least one peak to write capture to file\n", np08->writePeakCount);
+      break;
+#endif
+
+    case 'Z':
+      printf("Reset all parameters\n");
+      setNP08Default(unit, np08);
+      break;
+      
+    case 'X':
+      return;
+      
+    default:
+      break;
+    }  // End Switch
+  } while (1); // End do
+}
+
+void setNP08Expert(UNIT * unit, NP08VARS * np08) {
+  char ch = 'X';
   do {
     switch(ch) {
       
@@ -3045,18 +4387,18 @@ void NP08PeakFind2(UNIT * unit, NP08VARS * np08, FILE * file)
     
     // Write out the info in the line.
     if (ok[0] + ok[1] + ok[2] + ok[3] >= np08->writePeakCount) {
-      np08->currentFileSize += fprintf(file, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%6.2lf,%6.2lf,%6.2lf,%6.2lf,%d,%d,%d,%d", np08->currentLoopGroup, capture, okall, ok[0], ok[1], ok[2], ok[3], 
-				       index[0], index[1], index[2], index[3], interp[0], interp[1], interp[2], interp[3], height[0], height[1], height[2], height[3]);
+      NP08Printf(np08, file, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%6.2lf,%6.2lf,%6.2lf,%6.2lf,%d,%d,%d,%d", np08->currentLoopGroup, capture, okall, ok[0], ok[1], ok[2], ok[3], 
+		 index[0], index[1], index[2], index[3], interp[0], interp[1], interp[2], interp[3], height[0], height[1], height[2], height[3]);
       if (np08->waveOnOff) {
 	for (j = 0; j < 4; j++) {    // Write out the waveforms around the four signals, each fixed to 11 samples
 	  channel = searchchannel[j];    // Look on channel B,A,C,B for the four searches.
 	  for (k = index[j] - 7; k < index[j] + 7; k++) {// Include exactly 15 channels in waveform
-	    if (k < 0 || k >= np08->nSamples) np08->currentFileSize += fprintf(file, ",0");
-	    else np08->currentFileSize += fprintf(file, ",%d", np08->rapidBuffers[channel][capture][k]);
+	    if (k < 0 || k >= np08->nSamples) NP08Printf(np08, file, ",0");
+	    else NP08Printf(np08, file, ",%d", np08->rapidBuffers[channel][capture][k]);
 	  }
 	}
       }
-      np08->currentFileSize += fprintf(file, "\n");  // Finally end the line
+      NP08Printf(np08, file, "\n");  // Finally end the line
     }
   }
 }
@@ -3089,9 +4431,9 @@ void NP08PeakFind4(UNIT* unit, NP08VARS* np08, FILE* file)
 {
   uint32_t capture;
   int16_t channel;
-  int32_t vetoB = 30;  // Number of time ticks around the b1 to disable finding of b2
-  int32_t vetoC = 10;   // Number of time ticks around the a.b1 for the c1 to veto
-  int32_t coincAB = 5;   // Coincidence time in ticks for A and B to form coincidence
+  int32_t vetoB = (int32_t)np08->vetoB;  // Number of time ticks around the b1 to disable finding of b2
+  int32_t vetoC = (int32_t)np08->vetoC;  // Number of time ticks around the a.b1 for the c1 to veto
+  int32_t coincAB = np08->coincAB;       // Coincidence time in ticks for A and B to form coincidence
   int32_t i, j, k, k9;
   
   int index[4];
@@ -3301,22 +4643,22 @@ void NP08PeakFind4(UNIT* unit, NP08VARS* np08, FILE* file)
     //if (ok[0] + ok[1] + ok[2] + ok[3] >= np08->writePeakCount) {
     if (ok[0] != 0 && ok[1] != 0) {
       // Add the info that is the same as in NP08FindPeak2() first [So the start of the line is the same format]
-      np08->currentFileSize += fprintf(file, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%6.2lf,%6.2lf,%6.2lf,%6.2lf,%d,%d,%d,%d", np08->currentLoopGroup, capture, okall, ok[0], ok[1], ok[2], ok[3],
-				       index[0], index[1], index[2], index[3], interp[0], interp[1], interp[2], interp[3], height[0], height[1], height[2], height[3]);
+      NP08Printf(np08, file, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%6.2lf,%6.2lf,%6.2lf,%6.2lf,%d,%d,%d,%d", np08->currentLoopGroup, capture, okall, ok[0], ok[1], ok[2], ok[3],
+		 index[0], index[1], index[2], index[3], interp[0], interp[1], interp[2], interp[3], height[0], height[1], height[2], height[3]);
       // Now add the ex_things
-      np08->currentFileSize += fprintf(file, ",%d,%d,%d,%d,%d,%d,%d,%d,%6.2lf,%6.2lf,%6.2lf,%6.2lf,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d", ex_ok[0], ex_ok[1], ex_ok[2], ex_ok[3],
-				       ex_index[0], ex_index[1], ex_index[2], ex_index[3], ex_interp[0], ex_interp[1], ex_interp[2], ex_interp[3], ex_height[0], ex_height[1], ex_height[2], ex_height[3],
-				       ex_base[0], ex_base[1], ex_base[2], ex_base[3], ex_endindex[0], ex_endindex[1], ex_endindex[2], ex_endindex[3]);
+      NP08Printf(np08, file, ",%d,%d,%d,%d,%d,%d,%d,%d,%6.2lf,%6.2lf,%6.2lf,%6.2lf,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d", ex_ok[0], ex_ok[1], ex_ok[2], ex_ok[3],
+		 ex_index[0], ex_index[1], ex_index[2], ex_index[3], ex_interp[0], ex_interp[1], ex_interp[2], ex_interp[3], ex_height[0], ex_height[1], ex_height[2], ex_height[3],
+		 ex_base[0], ex_base[1], ex_base[2], ex_base[3], ex_endindex[0], ex_endindex[1], ex_endindex[2], ex_endindex[3]);
       if (np08->waveOnOff) {
 	for (j = 0; j < 4; j++) {    // Write out the waveforms around the four signals, each fixed to 11 samples
 	  channel = searchchannel[j];    // Look on channel B,A,C,B for the four searches.
 	  for (k = index[j] - 7; k < index[j] + 7; k++) {// Include exactly 15 channels in waveform
-	    if (k < 0 || k >= np08->nSamples) np08->currentFileSize += fprintf(file, ",0");
-	    else np08->currentFileSize += fprintf(file, ",%d", np08->rapidBuffers[channel][capture][k]);
+	    if (k < 0 || k >= np08->nSamples) NP08Printf(np08, file, ",0");
+	    else NP08Printf(np08, file, ",%d", np08->rapidBuffers[channel][capture][k]);
 	  }
 	}
       }
-      np08->currentFileSize += fprintf(file, "\n");  // Finally end the line
+      NP08Printf(np08, file, "\n");  // Finally end the line
     }
   }
 }
@@ -3336,253 +4678,2098 @@ void NP08PeakFind4(UNIT* unit, NP08VARS* np08, FILE* file)
 // followed by
 // 4x(flags if found peaks B3,B4,B5,B6), 4x(time bins where found), 4x(interpolated time), 4x(peak height), 4x(end-index)
 
-// The data record for NP08PeakFinder5 is:      ABCD for 4 channel scope, AB for 2channel scope
-// #g,#c,allok,[A1,B1,C1,D1]*(flag-if-peak-found,interpolated-time,peak-height       )
-//      if np08->cfdOnOff is set, bracket also contains (    ,time-bin-of-peak,cfd-front,cfd-back,end-time)
-// If np08->secondChan is not -1, i.e. second peak enabled => a fifth peak record is added for this
-// If waveOnOff is on, it writes 15 channels of waveform for each of the 2,4 or 5 peaks  
+/****************************************************************************
+* Baseline tracking for NP08PeakFind5
+*  The peak thresholds and heights are in absolute ADC counts, so a drift of
+*  the baseline (or an analogue offset) moves the effective threshold.  When
+*  np08->baseMode is set, NP08TrackBaseline() measures the mean and RMS of
+*  the pre-trigger samples of each channel in every capture (up to
+*  NP08_BASE_GUARD ticks before the trigger, where the pulse may start) and
+*  keeps running values over the last NP08_BASE_TAU or so captures.  A
+*  capture whose RMS is well above the running one has a pulse before the
+*  trigger and is left out; if that goes on for NP08_BASE_TAU captures the
+*  noise has really changed and the running values start again.  With
+*  baseMode 2 the peak thresholds count from the pedestal (NP08Threshold)
+*  and the heights are written relative to it.
+****************************************************************************/
+#define NP08_BASE_GUARD 10     // Ticks before the trigger not used for the pedestal
+#define NP08_BASE_TAU 256      // Captures in the running pedestal and noise
 
-void NP08PeakFind5(UNIT* unit, NP08VARS* np08, FILE* file)
+void NP08TrackBaseline(UNIT * unit, NP08VARS * np08, uint32_t capture)
 {
-  uint32_t capture;
-  int16_t channel;
-  int32_t vetoB = 30;  // Number of time ticks around the b1 to disable finding of b2
-  int32_t vetoC = 10;   // Number of time ticks around the a.b1 for the c1 to veto
-  int32_t coincAB = 5;   // Coincidence time in ticks for A and B to form coincidence
-  int32_t i, j, k, k9;
-  
-  int index[4];
-  int height[4], height1;     // Pulse height
-  double interp[4], interp1;  // Interpolated time
-  double p1, p2, p0;  // interp contains interpolated time
-  int ok[4], okall;
-  int close, dist, dist1, inpeak;
-  
-  // Info for the peaks B3,B4,B5,B6 These variables all start with ex_ (for 'extra')
-  int ex_ok[4];
-  int ex_index[4];
-  int ex_height[4];
-  int ex_base[4], base1;  // amplitude at base (lowest amplitude from the 20 samples before threshold)
-  int ex_hb[4], hb1, hb2, ihb2;   // hb = height - base.  This is the metric for picking the peaks to write
-  int ex_endindex[4], end1;
-  double ex_interp[4];
-  int j1;
-  
-  // Parameters:
-  //     np08->secondChan         Channel number to hunt for second peak
-  //     np08->secondMinDelay     Minimum delay from first peak to consider (was fixed at 50 ticks)
-  //     np08->writePeakCount     (exists, but currently ignored.  Value 0->3 = require peak on this channel to be above np08->writePeakHeight
-  //                                 Value 11->14 = require the number of channels with peaks to be bigger than this)
-  //     np08->writePeakHeight    Used as threshold on peak to write out (only works if higher than the time threshold, so may be useless)
-  //     np08->cfdOnOff           Enables writing CFD values
-  //     np08->waveOnOff          Enables writing wave samples
-
-  if (!np08->isMemAllocated) { printf("No data collected\n"); return; }
-  if (np08->statusBulk != PICO_OK || np08->statusTrig != PICO_OK) {
-    printf("Error when collecting data, not analysing it.  Codes are %d %d\n", np08->statusBulk, np08->statusTrig);
-    return;
-  }
+  int32_t j, i, len = np08->nPreSamples - NP08_BASE_GUARD;
+  int64_t s, s2;
+  int16_t * w;
+  int8_t * w8;
+  double m, r, wt;
+
+  if (len < 16) return;     // Not enough pre-trigger samples
+  for (j = 0; j < unit->channelCount && j < 4; j++) {
+    if (!unit->channelSettings[j].enabled) continue;
+    s = 0;
+    s2 = 0;
+    if (np08->packMask & (1 << j)) {   // Same sums from the packed samples, which are the samples / 256
+      w8 = np08->packBuffers[j][capture];
+      for (i = 0; i < len; i++) {
+	s += w8[i];
+	s2 += (int32_t)w8[i] * w8[i];
+      }
+      s <<= 8;
+      s2 <<= 16;
+    } else {
+      w = np08->rapidBuffers[j][capture];
+      for (i = 0; i < len; i++) {
+	s += w[i];
+	s2 += (int32_t)w[i] * w[i];
+      }
+    }
+    m = (double)s / len;
+    r = sqrt((double)s2 / len - m * m);
 
-  int32_t countCut2 = 0;
-  for (capture = 0; capture < np08->nCapturesM; capture++) {
-  
-    // This section finds the B3, B4, B5 and B6 pulses.  It acts indpendently of the section finding the B1, A1, C1 etc pulses,
-    // i.e. there are no times or pulse heights used in one that are needed in the other of thesse two algorithms.
-    // The four pulses found here are essentially unordered.   However, there is a section lower down that picks the 
-    // most favoured pulse using the same algorithm as PeakFinder4 used in 2020 & TT2021 for the B3 pulse.
-    
-    // Loop through finding the ex pulses one by one and keep the top four
-    for (j = 0; j < 4; j++) {  // First zero everything
-      ex_ok[j] = 0;
-      ex_index[j] = 0;
-      ex_height[j] = 0;
-      ex_interp[j] = 0.;
-      ex_base[j] = 0;
-      ex_endindex[j] = 0;
-      ex_hb[j] = 0;
+    if (np08->baseCount[j] > 0 && r > 2. * np08->baseRms[j] + 2.) {   // A pulse in there
+      if (++np08->baseReject[j] < NP08_BASE_TAU) continue;
+      np08->baseCount[j] = 0;
+    }
+    np08->baseReject[j] = 0;
+    if (np08->baseCount[j] < NP08_BASE_TAU) np08->baseCount[j]++;
+    wt = 1. / np08->baseCount[j];      // A plain mean to start with, then exponential
+    if (np08->baseCount[j] == 1) {
+      np08->basePed[j] = m;
+      np08->baseRms[j] = r;
+    } else {
+      np08->basePed[j] += (m - np08->basePed[j]) * wt;
+      np08->baseRms[j] += (r - np08->baseRms[j]) * wt;
     }
+  }
+}
 
-    // Now identify each time it crosses the threshold in the increasing direction 
-    channel = np08->secondChan;   // Was fixed to CHANNEL_B
-    if ((int)channel >= (int)0 && (int)channel < (int)unit->channelCount) {     // Value of -1 or too big disables secondary peak finding
-      for (i = 1; i < np08->nSamples; i++) {    // start at 1, not 0
+// The peak finding threshold of channel j, relative to the pedestal with baseMode 2
+static __forceinline int16_t NP08Threshold(NP08VARS * np08, int32_t j)
+{
+  int32_t thr = np08->peakThreshold[j];
 
-		if (!unit->channelSettings[channel].enabled) break;   // Don't find any peaks if channel is disabled.
-		p0 = np08->peakThreshold[channel];                   // Threshold, = desired ADC value to interpolate to
-		p1 = np08->rapidBuffers[channel][capture][i - 1];    // ADC value of previous
-		p2 = np08->rapidBuffers[channel][capture][i];        // ADC value of next
-		if (np08->rapidBuffers[channel][capture][i] > np08->peakThreshold[channel]) continue;  // Exit if pulse too small [It is if (p2 > p0) but in integer]
-		if (np08->rapidBuffers[channel][capture][i - 1] <= np08->peakThreshold[channel]) continue;  // Exit if not leading edge
-		p2 = p2 - p1;
-		if (p2 == 0.) p2 = 0.1;  // Avoid divide by zero in interpolation
-		interp1 = (p0 - p1) / p2 + i;
-	
-		// Search onward to find peak height, a maximum of 10 samples
-		k9 = i + 10;
-		if (k9 > np08->nSamples) k9 = np08->nSamples;
-		height1 = np08->rapidBuffers[channel][capture][i];
-		for (k = i + 1; k < k9; k++) {    // In this comparison, remember the peaks are negaive, i.e. '<' means 'higher amplitude'
-			if (np08->rapidBuffers[channel][capture][k] < height1) height1 = np08->rapidBuffers[channel][capture][k];
-			else break;    // Stop looking for peak as soon as it starts dipping down
-		}
-	
-		// Search back to find the base, it is the lowest amplitude tick among the previous 20
-		k9 = i - 20;
-		if (k9 < 0) k9 = 0;  // Don't go beyond start of buffer
-		base1 = np08->rapidBuffers[channel][capture][i];
-		for (k = k9; k < i; k++) {
-			if (np08->rapidBuffers[channel][capture][k] > base1) base1 = np08->rapidBuffers[channel][capture][k];
-		}
-		hb1 = -(height1 - base1);    // Postive number, the bigger number is the bigger pulse
-	
-		// Search forward to find the next place the pulse goes back below threshold
-		end1 = np08->nSamples;
-		for (k = i + 1; k < np08->nSamples; k++) {
-			end1 = k;
-			if (np08->rapidBuffers[channel][capture][k] > np08->peakThreshold[channel]) break;   // Amplitude went back below threshold
-		}
-	
-		// If our new pulse is bigger than the smallest of the four we have already, replace it
-		hb2 = ex_hb[0];
-		ihb2 = 0;  // Index of smallest
-		for (j = 1; j < 4; j++) {
-			if (ex_hb[j] < hb2) { hb2 = ex_hb[j]; ihb2 = j; }
-		}
-		//printf("DEBUG: capture %d hb1 %d hb2 %d ihb2 %d height1 %d index %d ex_hb[0..3] %d,%d,%d,%d\n", capture, hb1, hb2, ihb2,height1,i,ex_hb[0],ex_hb[1],ex_hb[2],ex_hb[3]);
-	
-		if (hb1 > hb2) {     // New peak has larger hb than previous, replace it
-			ex_ok[ihb2] = 1;  
-			ex_index[ihb2] = i; 
-			ex_interp[ihb2] = interp1; 
-			ex_height[ihb2] = height1; 
-			ex_base[ihb2] = base1;
-			ex_hb[ihb2] = hb1;
-			ex_endindex[ihb2] = end1;
-		}
-	  }  // End of loop over samples
-    }    // End if we have enabled extra peak finding
+  if (np08->baseMode == 2 && np08->baseCount[j] > 0) thr += (int32_t)lrint(np08->basePed[j]);
+  return (int16_t)((thr < -32768) ? -32768 : (thr > 32767) ? 32767 : thr);
+}
 
-    // This section finds the A! B1 C1 D1 pulses (was B1, A1, C1 and B2 pulses (B2 was useless))
-    for (j = 0; j < unit->channelCount; j++) {    // We do this procedure on each channel
-      index[j] = np08->nPreSamples;    // Initial setup
-      height[j] = 0;
-      interp[j] = 0.;
-      ok[j] = 0;                       // Initial setup
-      close = index[j];                // Start searching from the trigger time     
-      
-      // Now prepare to find the peaks
-      inpeak = 0;
-      dist = np08->nSamples * 2;   // How close are we, start way out.
-      channel = j;                 // Was = searchchannel[j]; to look on channel B,A,C,B for the four searches.
-      for (i = 1; i < np08->nSamples; i++) {    // start at 1, not 0
-        if (!(channel < unit->channelCount)) break;           // Don't find any peaks if channel is disabled.
-	if (!unit->channelSettings[channel].enabled) break;   // Don't find any peaks if channel is disabled.
-	if (inpeak > 0) inpeak--;     // Count down as we move away from previous peak, to ensure a gap
-	if (inpeak > 0) continue;     // Skip if we are close to previous peak
-	p0 = np08->peakThreshold[channel];                   // Threshold, = desired ADC value to interpolate to
-	p1 = np08->rapidBuffers[channel][capture][i - 1];    // ADC value of previous
-	p2 = np08->rapidBuffers[channel][capture][i];        // ADC value of next
-	if (np08->rapidBuffers[channel][capture][i]      > np08->peakThreshold[channel]) continue;  // Exit if pulse too small [It is if (p2 > p0) but in integer]
-	if (np08->rapidBuffers[channel][capture][i - 1] <= np08->peakThreshold[channel]) continue;  // Exit if not leading edge
-	p2 = p2 - p1;
-	if (p2 == 0.) p2 = 0.1;  // Avoid divide by zero in interpolation
-	interp1 = (p0 - p1) / p2 + i;
-	
-	// Search onward to find peak height, a maximum of 10 samples
-	k9 = i + 10;
-	if (k9 > np08->nSamples) k9 = np08->nSamples;
-	height1 = np08->rapidBuffers[channel][capture][i];
-	for (k = i + 1; k < k9; k++) {    // In this comparison, remember the peaks are negaive, i.e. '<' means 'higher amplitude'
-	  if (np08->rapidBuffers[channel][capture][k] < height1) height1 = np08->rapidBuffers[channel][capture][k];
-	  else break;    // Stop looking for peak as soon as it starts dipping down
-	}
-	
-        // TODO:  Insert CFD in here
+/****************************************************************************
+* Columnar copy of the NP08PeakFind5 records
+*  With np08->colMode set, NP08Loop() also writes the records to
+*  runD_XXXXXX_col.dat one column after the other, so an analysis that
+*  uses a few columns only reads those.  NP08ColumnsMake() lists the
+*  columns of the record as it is written with the settings of the run,
+*  with the names of the NP08 notebook (the record cut names, plus fitflag
+*  fitchi2 qratio ped rms and wave<letter><tick> for the fields that have
+*  no cut name).  The records written during a group are packed as one
+*  chunk, so a chunk can hold records of earlier groups released by the
+*  stitching (and a chunk ends early after NP08_COL_ROWS records).
+*  Every value is an integer, the number as in the text file times 10 to
+*  the power of the decimals of the column (so times are in hundredths of
+*  a tick).  In a chunk each column is packed in as few bits as it needs,
+*  either as the value less the least value of the chunk, or as the
+*  difference from the previous value less the least difference,
+*  whichever is shorter: flags take one bit, capture numbers one or two,
+*  and a column that is the same for the whole chunk takes none.
+*  The file is binary, little-endian:
+*    "NP08COL1", int32 runNumber, int32 number of columns,
+*    for each column char name[16], int32 decimals, int32 0
+*  then the chunks
+*    uint32 bytes in the chunk after this word, uint32 records,
+*    for each column an NP08COLCHUNK (48 bytes) with the least and most
+*      value in the chunk, for skipping chunks, and where its bits are
+*    the packed values, each column starting on a byte
+*  A reader reads the directories (seeking over the chunks with the
+*  first word), then only the bytes of the columns and chunks it needs.
+****************************************************************************/
 
-	// Above threshold
-	inpeak = 5;
-	dist1 = i - close;
-	if (dist1 < 0) dist1 = -dist1;  // abs(dist1)
-	if (dist1 < dist) { index[j] = i; interp[j] = interp1;  height[j] = height1;  ok[j] = 1; dist = dist1; }    // Closer than others, accept
-      }  // End of loop over sample times
-    }   // End of loop over scope channels
-    
-    // This little section helps the analysis clode by finding the preferred pulse from among B3,B4,B5,B6 (the ones in the ex_* variables here)
-    // Since the ex_ list was essentially unordered, nothing is lost, but it allows a decent analysis to hopefully be done by using B3 and ignoring the others.
-    
-    hb1 = 0;     // These are the ones that should work.  Biggest peak - base when skipping to tick 300
-    j1 = -3;	
-    for (j = 0; j < 4; j++) {   // Loop over the four extra pulses found
-		if (ex_index[j] == 0) continue;
-		if (ex_index[j] - index[0] < np08->secondMinDelay) continue;      // (timeThisPulse - timeB1) < 50 Attempt to chop out the big pulse after an early pulse
-		if (ex_hb[j] > hb1) {             // ex_hb More positive = bigger pulse
-			hb1 = ex_hb[j];
-			j1 = j;
-		}
-    }
+// a / b in thousandths, rounded half away from zero, 0 if b is 0.  The ratios are printed from
+// this so that the text and the columns round them once and the same way
+static int64_t NP08Thousandths(int32_t a, int32_t b)
+{
+  int64_t n = (int64_t)a * 1000, d = b;
 
-    if (j1 == -3) {    // No preferred peak found
-      ex_ok[0]=0; ex_index[0]=0; ex_height[0]=0; ex_interp[0]=0; ex_base[0]=0; ex_endindex[0]=0; ex_hb[0]=0;
-    } else if (j1 == 0) {    // Nothing to do, the preferred on is in position 0 already
-    } else {           // Move the preferred one to position 0
-      ex_ok[0]=ex_ok[j1]; ex_index[0]=ex_index[j1]; ex_height[0]=ex_height[j1]; ex_interp[0]=ex_interp[j1]; 
-      ex_base[0]=ex_base[j1]; ex_endindex[0]=ex_endindex[j1]; ex_hb[0]=ex_hb[j1];
-    }
+  if (d == 0) return 0;
+  if (d < 0) {
+    n = -n;
+    d = -d;
+  }
+  return (n >= 0) ? (n + d / 2) / d : -((d / 2 - n) / d);
+}
 
-    // TODO   Insert the CFD for the extra pulse here
+// Value of column c in the record ev, as an integer
+static int64_t NP08ColumnValue(const NP08COLUMN * c, const NP08EVENT * ev)
+{
+  const char * p = (const char *)ev;
+  int32_t x;
+
+  switch (c->type) {
+  case NP08_COL_TIME: return NP08_HUNDREDTHS(*(const int32_t *)(p + c->offset));
+  case NP08_COL_TENTHS: return llrint(*(const float *)(p + c->offset) * 10.);
+  case NP08_COL_RATIO: return NP08Thousandths(*(const int32_t *)(p + c->offset), *(const int32_t *)(p + c->offset2));
+  case NP08_COL_WAVE: return *(const int16_t *)(p + c->offset);
+  }
+  x = *(const int32_t *)(p + c->offset);
+  if (c->ped >= 0 && *(const int32_t *)(p + c->okOffset)) x -= (int32_t)lrintf(ev->ped[c->ped]);   // As NP08WriteEvent() does
+  return x;
+}
 
-    // Decide whether to write this one out
-    okall = 0;                               // It is bad trigger unless it passes all the following
-    if (np08->writePeakCount >=0 && np08->writePeakCount < unit->channelCount) {
-      if (ok[np08->writePeakCount]) okall = 1;
-    } else if (np08->writePeakCount >=10 && np08->writePeakCount < 14) {
-      if (ok[0]+ok[1]+ok[2]+ok[3] >= np08->writePeakCount-10) okall = 1;
-    }
-    
-    if (okall) {
+// Add a column called <field><letter><slot> (just field when letter is 0)
+static void NP08ColumnDefine(NP08VARS * np08, const char * field, char letter, int32_t slot, int32_t type,
+			     size_t offset, size_t offset2, size_t okOffset, int32_t ped)
+{
+  NP08COLUMN * c;
+
+  if (np08->colCount >= NP08_COL_MAX) return;
+  c = &np08->cols[np08->colCount++];
+  if (letter) snprintf(c->name, sizeof(c->name), "%s%c%d", field, letter, slot);
+  else snprintf(c->name, sizeof(c->name), "%s", field);
+  c->type = type;
+  c->offset = (int32_t)offset;
+  c->offset2 = (int32_t)offset2;
+  c->okOffset = (int32_t)okOffset;
+  c->ped = ped;
+}
 
-      //TODO We can implemnt the SW threshold trigger on one channel (writeCoun = 1->4) right at the start - zip through the samples of the selected channel anc hint for one big enough, then skip all the processing in the event if not satisfied.
-      // TODO write the new format, this is the old one still
+#define NP08_COL_AT(field, j) (offsetof(NP08EVENT, field) + (j) * sizeof(int))   // Offset of element j of an int array of NP08EVENT
 
-      // Add the info that is the same as in NP08FindPeak2() first [So the start of the line is the same format]
-      np08->currentFileSize += fprintf(file, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%6.2lf,%6.2lf,%6.2lf,%6.2lf,%d,%d,%d,%d", np08->currentLoopGroup, capture, okall, ok[0], ok[1], ok[2], ok[3],
-				       index[0], index[1], index[2], index[3], interp[0], interp[1], interp[2], interp[3], height[0], height[1], height[2], height[3]);
-      // Now add the ex_things
-      np08->currentFileSize += fprintf(file, ",%d,%d,%d,%d,%d,%d,%d,%d,%6.2lf,%6.2lf,%6.2lf,%6.2lf,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d", ex_ok[0], ex_ok[1], ex_ok[2], ex_ok[3],
-				       ex_index[0], ex_index[1], ex_index[2], ex_index[3], ex_interp[0], ex_interp[1], ex_interp[2], ex_interp[3], ex_height[0], ex_height[1], ex_height[2], ex_height[3],
-				       ex_base[0], ex_base[1], ex_base[2], ex_base[3], ex_endindex[0], ex_endindex[1], ex_endindex[2], ex_endindex[3]);
-	  countCut2++;
-      if (np08->waveOnOff) {
-	for (j = 0; j < unit->channelCount; j++) {    // Write out the waveforms around the four signals
-	  channel = j;    // Look on channel B,A,C,B for the four searches.
-	  for (k = index[j] - 7; k < index[j] + 7; k++) {// Include exactly 15 channels in waveform
-	    if (k < 0 || k >= np08->nSamples) np08->currentFileSize += fprintf(file, ",0");
-	    else np08->currentFileSize += fprintf(file, ",%d", np08->rapidBuffers[channel][capture][k]);
-	  }
-	}
+// Fill np08->cols[] with the columns of the record, in the order NP08WriteEvent() writes them
+void NP08ColumnsMake(UNIT * unit, NP08VARS * np08)
+{
+  char s = (np08->secondChan >= 0 && np08->secondChan < 4) ? 'a' + np08->secondChan : 'b';   // Letter of the extra pulses
+  int32_t rel = (np08->baseMode == 2 && np08->secondChan >= 0 && np08->secondChan < 4) ? np08->secondChan : -1;
+  int32_t j, k;
+
+  np08->colCount = 0;
+  NP08ColumnDefine(np08, "group", 0, 0, NP08_COL_INT, offsetof(NP08EVENT, group), 0, 0, -1);
+  NP08ColumnDefine(np08, "capture", 0, 0, NP08_COL_INT, offsetof(NP08EVENT, capture), 0, 0, -1);
+  NP08ColumnDefine(np08, "flagall", 0, 0, NP08_COL_INT, offsetof(NP08EVENT, okall), 0, 0, -1);
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "flag", 'a' + j, 1, NP08_COL_INT, NP08_COL_AT(ok, j), 0, 0, -1);
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "time", 'a' + j, 1, NP08_COL_INT, NP08_COL_AT(index, j), 0, 0, -1);
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "dtime", 'a' + j, 1, NP08_COL_TIME, NP08_COL_AT(interp, j), 0, 0, -1);
+  for (j = 0; j < 4; j++) {
+    NP08ColumnDefine(np08, "peak", 'a' + j, 1, NP08_COL_INT, NP08_COL_AT(height, j), 0, NP08_COL_AT(ok, j), (np08->baseMode == 2) ? j : -1);
+  }
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "flag", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_ok, j), 0, 0, -1);
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "time", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_index, j), 0, 0, -1);
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "dtime", s, j + 3, NP08_COL_TIME, NP08_COL_AT(ex_interp, j), 0, 0, -1);
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "peak", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_height, j), 0, NP08_COL_AT(ex_ok, j), rel);
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "base", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_base, j), 0, NP08_COL_AT(ex_ok, j), rel);
+  for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "endtime", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_endindex, j), 0, 0, -1);
+  if (np08->fitLearn > 0) {
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "fitflag", 'a' + j, 1, NP08_COL_INT, NP08_COL_AT(fitOk, j), 0, 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "fitamp", 'a' + j, 1, NP08_COL_INT, NP08_COL_AT(fitAmp, j), 0, 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "fittime", 'a' + j, 1, NP08_COL_TIME, NP08_COL_AT(fitTime, j), 0, 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "fitchi2", 'a' + j, 1, NP08_COL_TENTHS, offsetof(NP08EVENT, fitChi2) + j * sizeof(float), 0, 0, -1);
+  }
+  if (np08->chargeTotal > 0) {
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "qprompt", 'a' + j, 1, NP08_COL_INT, NP08_COL_AT(qPrompt, j), 0, 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "qtotal", 'a' + j, 1, NP08_COL_INT, NP08_COL_AT(qTotal, j), 0, 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "qratio", 'a' + j, 1, NP08_COL_RATIO, NP08_COL_AT(qPrompt, j), NP08_COL_AT(qTotal, j), 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "qprompt", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_qPrompt, j), 0, 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "qtotal", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_qTotal, j), 0, 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "qratio", s, j + 3, NP08_COL_RATIO, NP08_COL_AT(ex_qPrompt, j), NP08_COL_AT(ex_qTotal, j), 0, -1);
+  }
+  if (np08->baseMode > 0) {
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "ped", 'a' + j, 1, NP08_COL_TENTHS, offsetof(NP08EVENT, ped) + j * sizeof(float), 0, 0, -1);
+    for (j = 0; j < 4; j++) NP08ColumnDefine(np08, "rms", 'a' + j, 1, NP08_COL_TENTHS, offsetof(NP08EVENT, rms) + j * sizeof(float), 0, 0, -1);
+  }
+  if (np08->pileDip > 0) {
+    NP08ColumnDefine(np08, "pileflag", 0, 0, NP08_COL_INT, offsetof(NP08EVENT, pileOk), 0, 0, -1);
+    NP08ColumnDefine(np08, "piledtime1", 0, 0, NP08_COL_TIME, offsetof(NP08EVENT, pileFirst.interp), 0, 0, -1);
+    NP08ColumnDefine(np08, "pilepeak1", 0, 0, NP08_COL_INT, offsetof(NP08EVENT, pileFirst.height), 0, offsetof(NP08EVENT, pileOk), rel);
+    NP08ColumnDefine(np08, "piledtime2", 0, 0, NP08_COL_TIME, offsetof(NP08EVENT, pile.interp), 0, 0, -1);
+    NP08ColumnDefine(np08, "pilepeak2", 0, 0, NP08_COL_INT, offsetof(NP08EVENT, pile.height), 0, offsetof(NP08EVENT, pileOk), rel);
+  }
+  if (np08->exKeep > NP08_EX_SLOTS) {
+    NP08ColumnDefine(np08, "nex", 0, 0, NP08_COL_INT, offsetof(NP08EVENT, nex), 0, 0, -1);
+    for (j = NP08_EX_SLOTS; j <= np08->exKeep && j <= NP08_EX_MAX; j++) {
+      NP08ColumnDefine(np08, "flag", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_ok, j), 0, 0, -1);
+      NP08ColumnDefine(np08, "time", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_index, j), 0, 0, -1);
+      NP08ColumnDefine(np08, "dtime", s, j + 3, NP08_COL_TIME, NP08_COL_AT(ex_interp, j), 0, 0, -1);
+      NP08ColumnDefine(np08, "peak", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_height, j), 0, NP08_COL_AT(ex_ok, j), rel);
+      NP08ColumnDefine(np08, "base", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_base, j), 0, NP08_COL_AT(ex_ok, j), rel);
+      NP08ColumnDefine(np08, "endtime", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_endindex, j), 0, 0, -1);
+      if (np08->chargeTotal > 0) {
+	NP08ColumnDefine(np08, "qprompt", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_qPrompt, j), 0, 0, -1);
+	NP08ColumnDefine(np08, "qtotal", s, j + 3, NP08_COL_INT, NP08_COL_AT(ex_qTotal, j), 0, 0, -1);
       }
-      np08->currentFileSize += fprintf(file, "\n");  // Finally end the line
     }
-  }  // End loop over captures
-  np08->countCut2 = countCut2;
+  }
+  if (np08->waveOnOff) {
+    for (j = 0; j < unit->channelCount && j < 4; j++) {
+      for (k = 0; k < 14; k++) NP08ColumnDefine(np08, "wave", 'a' + j, k, NP08_COL_WAVE, offsetof(NP08EVENT, wave) + (j * 14 + k) * sizeof(int16_t), 0, 0, -1);
+    }
+  }
 }
 
-#if 0
-void NP08PeakFind9(UNIT * unit, NP08VARS * np08)
+// Decimals of the values of a column type
+static int32_t NP08ColumnDecimals(int32_t type)
 {
-  uint32_t capture;
-  int16_t channel;
-  int32_t i,j,tracelen;
-  char yes[100000];
-  
-  // Warn if the yes array is not big enough
-  if (np08->nSamples > 100000) {
-	  printf("Fixed length array is dimensioned at 100000 which is smaller than the number of samples, sorry\n");
-	  return;
+  return (type == NP08_COL_TIME) ? 2 : (type == NP08_COL_TENTHS) ? 1 : (type == NP08_COL_RATIO) ? 3 : 0;
+}
+
+// Bits needed for x
+static int32_t NP08BitWidth(uint64_t x)
+{
+  int32_t n = 0;
+
+  while (x) {
+    n++;
+    x >>= 1;
   }
+  return n;
+}
 
-  // May modify these to be arguments to the function call, so we can automate web page write
-  printf("Select capture to find peaks:\n");
+// Pack the n values of v (less the previous value when delta is set, from the second one) less base, in width bits each,
+// lowest bit first.  Returns the bytes.  The values come from 32 bit ones, so width is at most 43 and fits with the 7 bits left over
+static int32_t NP08BitPack(uint8_t * out, const int64_t * v, int32_t n, int32_t delta, int64_t base, int32_t width)
+{
+  uint64_t acc = 0;
+  int32_t bits = 0, len = 0, i;
+
+  if (width == 0) return 0;
+  for (i = delta; i < n; i++) {
+    acc |= (uint64_t)(v[i] - (delta ? v[i - 1] : 0) - base) << bits;
+    bits += width;
+    while (bits >= 8) {
+      out[len++] = (uint8_t)acc;
+      acc >>= 8;
+      bits -= 8;
+    }
+  }
+  if (bits > 0) out[len++] = (uint8_t)acc;
+  return len;
+}
+
+// Write the records collected so far as one chunk of np08->colFile
+static void NP08ColumnsChunk(NP08VARS * np08)
+{
+  NP08COLCHUNK * d;
+  const int64_t * v;
+  int64_t lo, hi;
+  uint32_t head[2], offset;
+  int32_t i, r, n = np08->colRows, wd;
+
+  offset = sizeof(head) + np08->colCount * sizeof(NP08COLCHUNK);
+  for (i = 0; i < np08->colCount; i++) {
+    d = &np08->colDir[i];
+    v = np08->colValues + (size_t)i * NP08_COL_ROWS;
+    memset(d, 0, sizeof(NP08COLCHUNK));
+    d->min = d->max = d->first = v[0];
+    lo = hi = 0;
+    for (r = 1; r < n; r++) {
+      if (v[r] < d->min) d->min = v[r];
+      if (v[r] > d->max) d->max = v[r];
+      if (r == 1 || v[r] - v[r - 1] < lo) lo = v[r] - v[r - 1];
+      if (r == 1 || v[r] - v[r - 1] > hi) hi = v[r] - v[r - 1];
+    }
+    d->base = d->min;
+    d->width = NP08BitWidth((uint64_t)(d->max - d->min));
+    wd = NP08BitWidth((uint64_t)(hi - lo));
+    if (n > 1 && wd < d->width) {    // The differences are shorter
+      d->encoding = 1;
+      d->base = lo;
+      d->width = wd;
+    }
+    d->offset = offset;
+    d->bytes = ((n - d->encoding) * d->width + 7) / 8;
+    offset += d->bytes;
+  }
+
+  head[0] = offset - sizeof(head[0]);
+  head[1] = n;
+  np08->colFileSize += NP08WriterPut(&np08->colWriter, np08->colFile, head, sizeof(head));
+  np08->colFileSize += NP08WriterPut(&np08->colWriter, np08->colFile, np08->colDir, np08->colCount * sizeof(NP08COLCHUNK));
+  for (i = 0; i < np08->colCount; i++) {
+    d = &np08->colDir[i];
+    r = NP08BitPack(np08->colBytes, np08->colValues + (size_t)i * NP08_COL_ROWS, n, d->encoding, d->base, d->width);
+    np08->colFileSize += NP08WriterPut(&np08->colWriter, np08->colFile, np08->colBytes, r);
+  }
+}
+
+/****************************************************************************
+* Arrow copy of the NP08PeakFind5 records
+*  With np08->arrowMode set, NP08Loop() also writes the columns of
+*  NP08ColumnsMake() to runD_XXXXXX.feather, an Apache Arrow IPC file
+*  (Feather version 2), so the notebooks can do
+*    DFinp = pd.read_feather(FileName)
+*  or memory map it with pyarrow.ipc.open_file(pyarrow.memory_map(...)),
+*  instead of pd.read_csv with a list of the column names kept by hand.
+*  The schema comes from the same column list as the columnar file, so the
+*  names are the notebook names and follow the settings of the run.
+*  Columns with no decimals are int32, the others (times, ratios, tenths)
+*  float64, the integer of the columnar file over 10, 100 or 1000, which
+*  is the same double as the number printed in the text file reads as
+*  (the ratios are rounded once for both, by NP08Thousandths()).  No
+*  column has nulls and nothing is compressed.  The records written
+*  during a group are one record batch (the chunks of the columnar file),
+*  and the footer with where the batches are is written at the end of the
+*  run, so the file can only be read once the run has finished.
+*  The Arrow metadata are flatbuffers, built here front to back by
+*  NP08FlatTable() and the functions after it: the children of a table
+*  are put after it and its offsets to them filled in once they are there.
+****************************************************************************/
+
+// Room for n more bytes at the end, zeroed and aligned to align.  Returns where they start
+static int32_t NP08FlatAlloc(NP08FLAT * fb, int32_t n, int32_t align)
+{
+  int32_t pos = (fb->len + align - 1) & ~(align - 1), size;
+  uint8_t * p;
+
+  if (pos + n > fb->size) {
+    size = (2 * fb->size > pos + n + 4096) ? 2 * fb->size : pos + n + 4096;
+    p = (uint8_t *)realloc(fb->buf, size);
+    if (p == NULL) {
+      fb->bad = 1;
+      return 0;    // Written over, but the message is not used
+    }
+    fb->buf = p;
+    fb->size = size;
+  }
+  memset(fb->buf + fb->len, 0, pos + n - fb->len);
+  fb->len = pos + n;
+  return pos;
+}
+
+static void NP08FlatPut(NP08FLAT * fb, int32_t at, const void * value, int32_t n)
+{
+  if (!fb->bad) memcpy(fb->buf + at, value, n);
+}
+
+// The offset at at points to target, which comes after it
+static void NP08FlatRef(NP08FLAT * fb, int32_t at, int32_t target)
+{
+  uint32_t d = target - at;
+
+  NP08FlatPut(fb, at, &d, 4);
+}
+
+// A table of nf fields of size[i] bytes each (0 = left out, 4 for an offset), preceded by its vtable.  pos[i] is set to
+// where field i goes.  The fields are laid out biggest first so each is aligned to its size.  Returns where the table is
+static int32_t NP08FlatTable(NP08FLAT * fb, int32_t nf, const int32_t * size, int32_t * pos)
+{
+  int32_t v, t, i, k, at = 4;
+  uint16_t e;
+
+  for (i = 0; i < nf; i++) if (size[i] == 8) at = 8;
+  for (k = 8; k >= 1; k /= 2) {
+    for (i = 0; i < nf; i++) {
+      if (size[i] != k) continue;
+      pos[i] = at;
+      at += k;
+    }
+  }
+  v = NP08FlatAlloc(fb, 4 + 2 * nf, 2);
+  t = NP08FlatAlloc(fb, at, 8);
+  e = 4 + 2 * nf;
+  NP08FlatPut(fb, v, &e, 2);
+  e = at;
+  NP08FlatPut(fb, v + 2, &e, 2);
+  for (i = 0; i < nf; i++) {
+    e = size[i] ? pos[i] : 0;
+    NP08FlatPut(fb, v + 4 + 2 * i, &e, 2);
+    pos[i] += t;
+  }
+  k = t - v;
+  NP08FlatPut(fb, t, &k, 4);
+  return t;
+}
+
+// A vector of n elements of elem bytes (structs of 8 byte fields when elem is a multiple of 8, aligned to 8).  Returns where
+// its length is, the elements follow
+static int32_t NP08FlatVector(NP08FLAT * fb, int32_t n, int32_t elem)
+{
+  int32_t pad = ((fb->len + 3) & ~3) - fb->len, p;
+
+  if (elem % 8 == 0 && ((fb->len + pad) & 7) == 0) pad += 4;
+  p = NP08FlatAlloc(fb, pad + 4 + n * elem, 1) + pad;
+  NP08FlatPut(fb, p, &n, 4);
+  return p;
+}
+
+static int32_t NP08FlatString(NP08FLAT * fb, const char * s)
+{
+  int32_t n = (int32_t)strlen(s), p = NP08FlatAlloc(fb, 4 + n + 1, 4);
+
+  NP08FlatPut(fb, p, &n, 4);
+  NP08FlatPut(fb, p + 4, s, n);
+  return p;
+}
+
+// The Schema table of the Arrow file, one field for each column.  Returns where it is
+static int32_t NP08ArrowSchema(NP08FLAT * fb, NP08VARS * np08)
+{
+  static const int32_t ss[2] = { 0, 4 }, fs[6] = { 4, 0, 1, 4, 0, 4 }, is[2] = { 4, 1 }, ds[1] = { 2 };
+  int32_t sp[2], fp[6], tp[2], s, v, f, t, i, x;
+
+  s = NP08FlatTable(fb, 2, ss, sp);    // Schema: endianness (little), fields
+  v = NP08FlatVector(fb, np08->colCount, 4);
+  NP08FlatRef(fb, sp[1], v);
+  for (i = 0; i < np08->colCount; i++) {
+    f = NP08FlatTable(fb, 6, fs, fp);  // Field: name, nullable (no), type_type, type, dictionary, children
+    NP08FlatRef(fb, v + 4 + 4 * i, f);
+    NP08FlatRef(fb, fp[0], NP08FlatString(fb, np08->cols[i].name));
+    if (NP08ColumnDecimals(np08->cols[i].type) > 0) {
+      fb->buf[fp[2]] = 3;              // FloatingPoint, of precision double
+      t = NP08FlatTable(fb, 1, ds, tp);
+      x = 2;
+      NP08FlatPut(fb, tp[0], &x, 2);
+    } else {
+      fb->buf[fp[2]] = 2;              // Int, 32 bits signed
+      t = NP08FlatTable(fb, 2, is, tp);
+      x = 32;
+      NP08FlatPut(fb, tp[0], &x, 4);
+      fb->buf[tp[1]] = 1;
+    }
+    NP08FlatRef(fb, fp[3], t);
+    NP08FlatRef(fb, fp[5], NP08FlatVector(fb, 0, 4));
+  }
+  return s;
+}
+
+// Start a Message of the given header type (1 Schema, 3 RecordBatch) with a body of body bytes.  Returns where its header goes
+static int32_t NP08ArrowMessage(NP08FLAT * fb, int32_t type, int64_t body)
+{
+  static const int32_t ms[4] = { 2, 1, 4, 8 };
+  int32_t mp[4], root, m, x = 4;
+
+  fb->len = 0;
+  fb->bad = 0;
+  root = NP08FlatAlloc(fb, 4, 4);
+  m = NP08FlatTable(fb, 4, ms, mp);    // Message: version (V5), header_type, header, bodyLength
+  NP08FlatRef(fb, root, m);
+  NP08FlatPut(fb, mp[0], &x, 2);
+  fb->buf[mp[1]] = (uint8_t)type;
+  NP08FlatPut(fb, mp[3], &body, 8);
+  return mp[2];
+}
+
+// Write np08->arrowMeta as an encapsulated message (continuation, length, metadata padded to 8 bytes).  Returns the bytes
+static int32_t NP08ArrowPutMeta(NP08VARS * np08)
+{
+  NP08FLAT * fb = &np08->arrowMeta;
+  int32_t head[2];
+
+  head[0] = -1;
+  head[1] = (fb->len + 7) & ~7;
+  NP08FlatAlloc(fb, head[1] - fb->len, 1);    // The padding
+  np08->arrowFileSize += NP08WriterPut(&np08->arrowWriter, np08->arrowFile, head, sizeof(head));
+  np08->arrowFileSize += NP08WriterPut(&np08->arrowWriter, np08->arrowFile, fb->buf, head[1]);
+  return sizeof(head) + head[1];
+}
+
+// Write the file signature and the schema
+static void NP08ArrowStart(NP08VARS * np08)
+{
+  NP08FLAT * fb = &np08->arrowMeta;
+  int32_t h;
+
+  fb->buf = NULL;
+  fb->size = 0;
+  np08->arrowBlocks = NULL;
+  np08->arrowCount = np08->arrowSize = 0;
+  np08->arrowFileSize = NP08WriterPut(&np08->arrowWriter, np08->arrowFile, "ARROW1\0", 8);
+  h = NP08ArrowMessage(fb, 1, 0);
+  NP08FlatRef(fb, h, NP08ArrowSchema(fb, np08));
+  if (fb->bad) {
+    printf("Not enough memory for the Arrow schema\n");
+    return;
+  }
+  NP08ArrowPutMeta(np08);
+}
+
+// Write the records collected so far as one record batch of np08->arrowFile
+static void NP08ArrowBatch(NP08VARS * np08)
+{
+  static const int32_t rs[3] = { 8, 4, 4 };
+  NP08FLAT * fb = &np08->arrowMeta;
+  NP08ARROWBLOCK * b;
+  const int64_t * v;
+  int64_t node[2], buffer[4], body = 0, len;
+  int32_t rp[3], h, nv, bv, i, r, dec, n = np08->colRows;
+  double scale;
+
+  if (np08->arrowCount == np08->arrowSize) {
+    b = (NP08ARROWBLOCK *)realloc(np08->arrowBlocks, (np08->arrowSize + 1024) * sizeof(NP08ARROWBLOCK));
+    if (b == NULL) {
+      printf("Not enough memory to add to the Arrow file\n");
+      return;
+    }
+    np08->arrowBlocks = b;
+    np08->arrowSize += 1024;
+  }
+  for (i = 0; i < np08->colCount; i++) body += (n * (NP08ColumnDecimals(np08->cols[i].type) > 0 ? 8 : 4) + 7) & ~7;
+
+  h = NP08ArrowMessage(fb, 3, body);
+  r = NP08FlatTable(fb, 3, rs, rp);    // RecordBatch: length, nodes, buffers
+  NP08FlatRef(fb, h, r);
+  len = n;
+  NP08FlatPut(fb, rp[0], &len, 8);
+  nv = NP08FlatVector(fb, np08->colCount, 16);
+  NP08FlatRef(fb, rp[1], nv);
+  bv = NP08FlatVector(fb, 2 * np08->colCount, 16);
+  NP08FlatRef(fb, rp[2], bv);
+  body = 0;
+  for (i = 0; i < np08->colCount; i++) {
+    node[0] = n;                       // FieldNode: length, null count
+    node[1] = 0;
+    NP08FlatPut(fb, nv + 4 + 16 * i, node, sizeof(node));
+    buffer[0] = body;                  // Buffer: offset, length of the validity bitmap (none) and of the values
+    buffer[1] = 0;
+    buffer[2] = body;
+    buffer[3] = (int64_t)n * (NP08ColumnDecimals(np08->cols[i].type) > 0 ? 8 : 4);
+    NP08FlatPut(fb, bv + 4 + 32 * i, buffer, sizeof(buffer));
+    body += (buffer[3] + 7) & ~7;
+  }
+  if (fb->bad) {
+    printf("Not enough memory to add to the Arrow file\n");
+    return;
+  }
+
+  b = &np08->arrowBlocks[np08->arrowCount++];
+  memset(b, 0, sizeof(NP08ARROWBLOCK));
+  b->offset = np08->arrowFileSize;
+  b->metaLength = NP08ArrowPutMeta(np08);
+  b->bodyLength = body;
+  for (i = 0; i < np08->colCount; i++) {
+    v = np08->colValues + (size_t)i * NP08_COL_ROWS;
+    dec = NP08ColumnDecimals(np08->cols[i].type);
+    memset(np08->colBytes, 0, (size_t)n * 8 + 8);
+    if (dec > 0) {
+      scale = (dec == 1) ? 10. : (dec == 2) ? 100. : 1000.;
+      for (r = 0; r < n; r++) ((double *)np08->colBytes)[r] = v[r] / scale;
+      len = (int64_t)n * 8;
+    } else {
+      for (r = 0; r < n; r++) ((int32_t *)np08->colBytes)[r] = (int32_t)v[r];
+      len = ((int64_t)n * 4 + 7) & ~7;
+    }
+    np08->arrowFileSize += NP08WriterPut(&np08->arrowWriter, np08->arrowFile, np08->colBytes, (int32_t)len);
+  }
+}
+
+// Write the end of stream marker and the footer, so the file can be read
+static void NP08ArrowEnd(NP08VARS * np08)
+{
+  static const int32_t fs[4] = { 2, 4, 4, 4 };
+  NP08FLAT * fb = &np08->arrowMeta;
+  int32_t fp[4], root, f, bv, x = 4, eos[2] = { -1, 0 };
+
+  np08->arrowFileSize += NP08WriterPut(&np08->arrowWriter, np08->arrowFile, eos, sizeof(eos));
+  fb->len = 0;
+  fb->bad = 0;
+  root = NP08FlatAlloc(fb, 4, 4);
+  f = NP08FlatTable(fb, 4, fs, fp);    // Footer: version (V5), schema, dictionaries (none), recordBatches
+  NP08FlatRef(fb, root, f);
+  NP08FlatPut(fb, fp[0], &x, 2);
+  NP08FlatRef(fb, fp[1], NP08ArrowSchema(fb, np08));
+  NP08FlatRef(fb, fp[2], NP08FlatVector(fb, 0, 24));
+  bv = NP08FlatVector(fb, np08->arrowCount, 24);
+  NP08FlatRef(fb, fp[3], bv);
+  NP08FlatPut(fb, bv + 4, np08->arrowBlocks, np08->arrowCount * sizeof(NP08ARROWBLOCK));
+  if (fb->bad) {
+    printf("Not enough memory for the Arrow footer, the file can not be read\n");
+    return;
+  }
+  np08->arrowFileSize += NP08WriterPut(&np08->arrowWriter, np08->arrowFile, fb->buf, fb->len);
+  np08->arrowFileSize += NP08WriterPut(&np08->arrowWriter, np08->arrowFile, &fb->len, 4);
+  np08->arrowFileSize += NP08WriterPut(&np08->arrowWriter, np08->arrowFile, "ARROW1", 6);
+}
+
+// Write the records collected so far, as a chunk of the columnar file and as a record batch of the Arrow file
+void NP08ColumnsFlush(NP08VARS * np08)
+{
+  if (np08->colValues == NULL || np08->colRows == 0) return;
+  if (np08->colFile != NULL) NP08ColumnsChunk(np08);
+  if (np08->arrowFile != NULL) NP08ArrowBatch(np08);
+  np08->colRows = 0;
+}
+
+// Add the record ev to the chunk being filled
+void NP08ColumnsRecord(NP08VARS * np08, const NP08EVENT * ev)
+{
+  int32_t i;
+
+  if (np08->colRows == NP08_COL_ROWS) NP08ColumnsFlush(np08);
+  for (i = 0; i < np08->colCount; i++) np08->colValues[(size_t)i * NP08_COL_ROWS + np08->colRows] = NP08ColumnValue(&np08->cols[i], ev);
+  np08->colRows++;
+}
+
+// Set up the columns for np08->colFile and np08->arrowFile, whichever have just been opened, and write their headers.
+// Returns 0 if there is not the memory
+int NP08ColumnsStart(UNIT * unit, NP08VARS * np08)
+{
+  int32_t i, c[2];
+
+  NP08ColumnsMake(unit, np08);
+  np08->colRows = 0;
+  np08->colFileSize = 0;
+  np08->colValues = (int64_t *)malloc((size_t)np08->colCount * NP08_COL_ROWS * sizeof(int64_t));
+  np08->colDir = (NP08COLCHUNK *)malloc(np08->colCount * sizeof(NP08COLCHUNK));
+  np08->colBytes = (uint8_t *)malloc(NP08_COL_ROWS * sizeof(int64_t) + 8);
+  if (np08->colValues == NULL || np08->colDir == NULL || np08->colBytes == NULL) {
+    free(np08->colValues);
+    free(np08->colDir);
+    free(np08->colBytes);
+    np08->colValues = NULL;
+    return 0;
+  }
+  if (np08->arrowFile != NULL) {
+    NP08WriterStart(np08, &np08->arrowWriter, np08->arrowFile);
+    NP08ArrowStart(np08);
+  }
+  if (np08->colFile == NULL) return 1;
+  c[0] = np08->runNumber;
+  c[1] = np08->colCount;
+  np08->colFileSize += fwrite("NP08COL1", 1, 8, np08->colFile);
+  np08->colFileSize += fwrite(c, 1, sizeof(c), np08->colFile);
+  for (i = 0; i < np08->colCount; i++) {
+    c[0] = NP08ColumnDecimals(np08->cols[i].type);
+    c[1] = 0;
+    np08->colFileSize += fwrite(np08->cols[i].name, 1, sizeof(np08->cols[i].name), np08->colFile);
+    np08->colFileSize += fwrite(c, 1, sizeof(c), np08->colFile);
+  }
+  NP08WriterStart(np08, &np08->colWriter, np08->colFile);
+  return 1;
+}
+
+// Write the last chunk, finish the Arrow file, stop the writer threads and free the memory.  The files are left open
+void NP08ColumnsStop(NP08VARS * np08)
+{
+  if (np08->colValues == NULL) return;
+  NP08ColumnsFlush(np08);
+  NP08WriterStop(&np08->colWriter);
+  if (np08->arrowFile != NULL) {
+    NP08ArrowEnd(np08);
+    NP08WriterStop(&np08->arrowWriter);
+    free(np08->arrowMeta.buf);
+    free(np08->arrowBlocks);
+  }
+  free(np08->colValues);
+  free(np08->colDir);
+  free(np08->colBytes);
+  np08->colValues = NULL;
+}
+
+/****************************************************************************
+* NP08WriteEvent
+*  Writes one NP08PeakFind5 record to the file, unless it fails the record
+*  cut np08->cutExpr.  Held records get here after any stitching, so the cut
+*  sees the decay pulses stitched in from later captures.
+****************************************************************************/
+void NP08WriteEvent(UNIT* unit, NP08VARS* np08, FILE* file, NP08EVENT* ev)
+{
+  int j, k;
+  int64_t t[4], ex_t[4];   // Interpolated times in hundredths of a tick, printed in the same %6.2lf layout as when they were doubles
+  int h[4], ex_h[4], ex_b[4], rel, r;
+
+  if (np08->cutCount > 0 && !NP08CutEval(np08, ev)) return;
+  np08->recordCount++;
+  if (np08->colValues != NULL) NP08ColumnsRecord(np08, ev);
+
+  for (j = 0; j < 4; j++) {
+    t[j] = NP08_HUNDREDTHS(ev->interp[j]);
+    ex_t[j] = NP08_HUNDREDTHS(ev->ex_interp[j]);
+  }
+
+  // Heights relative to the pedestal with baseMode 2 (the extra pulses are on secondChan)
+  rel = (np08->baseMode == 2 && np08->secondChan >= 0 && np08->secondChan < 4) ? (int)lrintf(ev->ped[np08->secondChan]) : 0;
+  for (j = 0; j < 4; j++) {
+    h[j] = ev->height[j] - ((np08->baseMode == 2 && ev->ok[j]) ? (int)lrintf(ev->ped[j]) : 0);
+    ex_h[j] = ev->ex_height[j] - (ev->ex_ok[j] ? rel : 0);
+    ex_b[j] = ev->ex_base[j] - (ev->ex_ok[j] ? rel : 0);
+  }
+
+  // Add the info that is the same as in NP08FindPeak2() first [So the start of the line is the same format]
+  NP08Printf(np08, file, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%3d.%02d,%3d.%02d,%3d.%02d,%3d.%02d,%d,%d,%d,%d", ev->group, ev->capture, ev->okall, ev->ok[0], ev->ok[1], ev->ok[2], ev->ok[3],
+	     ev->index[0], ev->index[1], ev->index[2], ev->index[3],
+	     (int)(t[0] / 100), (int)(t[0] % 100), (int)(t[1] / 100), (int)(t[1] % 100), (int)(t[2] / 100), (int)(t[2] % 100), (int)(t[3] / 100), (int)(t[3] % 100),
+	     h[0], h[1], h[2], h[3]);
+  // Now add the ex_things
+  NP08Printf(np08, file, ",%d,%d,%d,%d,%d,%d,%d,%d,%3d.%02d,%3d.%02d,%3d.%02d,%3d.%02d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d", ev->ex_ok[0], ev->ex_ok[1], ev->ex_ok[2], ev->ex_ok[3],
+	     ev->ex_index[0], ev->ex_index[1], ev->ex_index[2], ev->ex_index[3],
+	     (int)(ex_t[0] / 100), (int)(ex_t[0] % 100), (int)(ex_t[1] / 100), (int)(ex_t[1] % 100), (int)(ex_t[2] / 100), (int)(ex_t[2] % 100), (int)(ex_t[3] / 100), (int)(ex_t[3] % 100),
+	     ex_h[0], ex_h[1], ex_h[2], ex_h[3],
+	     ex_b[0], ex_b[1], ex_b[2], ex_b[3], ev->ex_endindex[0], ev->ex_endindex[1], ev->ex_endindex[2], ev->ex_endindex[3]);
+  if (np08->fitLearn > 0) {    // The template fit
+    for (j = 0; j < 4; j++) t[j] = NP08_HUNDREDTHS(ev->fitTime[j]);
+    NP08Printf(np08, file, ",%d,%d,%d,%d,%d,%d,%d,%d,%3d.%02d,%3d.%02d,%3d.%02d,%3d.%02d,%.1f,%.1f,%.1f,%.1f",
+	       ev->fitOk[0], ev->fitOk[1], ev->fitOk[2], ev->fitOk[3], ev->fitAmp[0], ev->fitAmp[1], ev->fitAmp[2], ev->fitAmp[3],
+	       (int)(t[0] / 100), (int)(t[0] % 100), (int)(t[1] / 100), (int)(t[1] % 100), (int)(t[2] / 100), (int)(t[2] % 100), (int)(t[3] / 100), (int)(t[3] % 100),
+	       ev->fitChi2[0], ev->fitChi2[1], ev->fitChi2[2], ev->fitChi2[3]);
+  }
+  if (np08->chargeTotal > 0) {    // The charges
+    NP08Printf(np08, file, ",%d,%d,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f",
+	       ev->qPrompt[0], ev->qPrompt[1], ev->qPrompt[2], ev->qPrompt[3], ev->qTotal[0], ev->qTotal[1], ev->qTotal[2], ev->qTotal[3],
+	       NP08_RATIO(ev->qPrompt[0], ev->qTotal[0]), NP08_RATIO(ev->qPrompt[1], ev->qTotal[1]),
+	       NP08_RATIO(ev->qPrompt[2], ev->qTotal[2]), NP08_RATIO(ev->qPrompt[3], ev->qTotal[3]));
+    NP08Printf(np08, file, ",%d,%d,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f",
+	       ev->ex_qPrompt[0], ev->ex_qPrompt[1], ev->ex_qPrompt[2], ev->ex_qPrompt[3], ev->ex_qTotal[0], ev->ex_qTotal[1], ev->ex_qTotal[2], ev->ex_qTotal[3],
+	       NP08_RATIO(ev->ex_qPrompt[0], ev->ex_qTotal[0]), NP08_RATIO(ev->ex_qPrompt[1], ev->ex_qTotal[1]),
+	       NP08_RATIO(ev->ex_qPrompt[2], ev->ex_qTotal[2]), NP08_RATIO(ev->ex_qPrompt[3], ev->ex_qTotal[3]));
+  }
+
+  if (np08->baseMode > 0) {    // The running pedestal and noise
+    NP08Printf(np08, file, ",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f", ev->ped[0], ev->ped[1], ev->ped[2], ev->ped[3],
+	       ev->rms[0], ev->rms[1], ev->rms[2], ev->rms[3]);
+  }
+  if (np08->pileDip > 0) {    // The two pulses of a pile-up on the second channel
+    t[0] = NP08_HUNDREDTHS(ev->pileFirst.interp);
+    t[1] = NP08_HUNDREDTHS(ev->pile.interp);
+    r = ev->pileOk ? rel : 0;
+    NP08Printf(np08, file, ",%d,%3d.%02d,%d,%3d.%02d,%d", ev->pileOk, (int)(t[0] / 100), (int)(t[0] % 100), ev->pileFirst.height - r,
+	       (int)(t[1] / 100), (int)(t[1] % 100), ev->pile.height - r);
+  }
+  if (np08->exKeep > NP08_EX_SLOTS) {    // The extra pulses that are not in the fixed columns
+    NP08Printf(np08, file, ",%d", ev->nex);
+    for (j = NP08_EX_SLOTS; j <= np08->exKeep && j <= NP08_EX_MAX; j++) {
+      t[0] = NP08_HUNDREDTHS(ev->ex_interp[j]);
+      r = ev->ex_ok[j] ? rel : 0;
+      NP08Printf(np08, file, ",%d,%d,%3d.%02d,%d,%d,%d", ev->ex_ok[j], ev->ex_index[j], (int)(t[0] / 100), (int)(t[0] % 100),
+		 ev->ex_height[j] - r, ev->ex_base[j] - r, ev->ex_endindex[j]);
+      if (np08->chargeTotal > 0) NP08Printf(np08, file, ",%d,%d", ev->ex_qPrompt[j], ev->ex_qTotal[j]);
+    }
+  }
+  if (np08->waveOnOff) {
+    for (j = 0; j < unit->channelCount; j++) {    // Write out the waveforms around the four signals
+      for (k = 0; k < 14; k++) NP08Printf(np08, file, ",%d", ev->wave[j][k]);
+    }
+  }
+  NP08Printf(np08, file, "\n");  // Finally end the line
+}
+
+/****************************************************************************
+* Cross-capture stitching for NP08PeakFind5
+*  A muon that stops near the end of a capture can decay after the window has
+*  closed, and then the decay pulse triggers the next capture.  When
+*  np08->stitchWindow is non-zero, the records that pass cut2 are held in
+*  np08->stitchEvents[] instead of being written straight away, and the main
+*  pulse on np08->secondChan of each later capture is offered to them, using
+*  the trigger time stamps to put it on the time axis of the held capture.
+*  If it is within np08->stitchWindow ticks of that trigger and the held
+*  capture found no preferred extra pulse of its own, it becomes the preferred
+*  extra pulse with ex_ok = 3.  Its times are in ticks of the original capture,
+*  so they are beyond nSamples.  Records are written in order once no later
+*  capture can add to them, or at the end by NP08StitchRelease(..., 1).
+****************************************************************************/
+
+// Write out the held records that can no longer change (all of them if all is set).  tick is the time stamp of the current capture
+void NP08StitchRelease(UNIT* unit, NP08VARS* np08, FILE* file, uint64_t tick, int all)
+{
+  NP08EVENT * ev;
+  uint64_t dt;
+
+  while (np08->stitchCount > 0) {
+    ev = &np08->stitchEvents[np08->stitchFirst];
+    dt = (tick - ev->tick) & NP08_TIMESTAMP_MASK;
+    if (!all && ev->ex_ok[0] == 0 && dt <= (uint64_t)np08->stitchWindow + np08->nPreSamples) break;   // Could still get a decay
+    NP08WriteEvent(unit, np08, file, ev);
+    np08->stitchFirst = (np08->stitchFirst + 1) % NP08_STITCH_DEPTH;
+    np08->stitchCount--;
+  }
+}
+
+// Hold a record back (or write it if there is nothing held and it already has its decay)
+void NP08StitchAdd(UNIT* unit, NP08VARS* np08, FILE* file, NP08EVENT* ev)
+{
+  if (np08->stitchCount == 0 && ev->ex_ok[0] != 0) {
+    NP08WriteEvent(unit, np08, file, ev);
+    return;
+  }
+  if (np08->stitchCount == NP08_STITCH_DEPTH) {   // Full, the oldest one has to go
+    NP08WriteEvent(unit, np08, file, &np08->stitchEvents[np08->stitchFirst]);
+    np08->stitchFirst = (np08->stitchFirst + 1) % NP08_STITCH_DEPTH;
+    np08->stitchCount--;
+  }
+  np08->stitchEvents[(np08->stitchFirst + np08->stitchCount) % NP08_STITCH_DEPTH] = *ev;
+  np08->stitchCount++;
+}
+
+// Offer the pulse at index (interp, height) on np08->secondChan of this capture to the held records, newest first
+void NP08StitchOffer(NP08VARS* np08, uint32_t capture, uint64_t tick, int index, int32_t interp, int height)
+{
+  int32_t n, k, k9, base, end;
+  int64_t dt, pos;
+  NP08EVENT * ev;
+  int16_t * w = np08->rapidBuffers[np08->secondChan][capture];
+
+  for (n = np08->stitchCount - 1; n >= 0; n--) {
+    ev = &np08->stitchEvents[(np08->stitchFirst + n) % NP08_STITCH_DEPTH];
+    dt = (int64_t)((tick - ev->tick) & NP08_TIMESTAMP_MASK);
+    pos = dt + index;                                   // Tick of the pulse on the time axis of the held capture
+    if (pos - np08->nPreSamples > np08->stitchWindow) break;   // Too late for this one, and the older ones
+    if (ev->ex_ok[0] != 0) continue;                    // Already has a decay
+    if (pos - ev->index[0] < np08->secondMinDelay) continue;
+
+    // Base and end as in the extra pulse search of NP08PeakFind5()
+    k9 = index - 20;
+    if (k9 < 0) k9 = 0;
+    base = w[index];
+    for (k = k9; k < index; k++) {
+      if (w[k] > base) base = w[k];
+    }
+    end = np08->nSamples;
+    for (k = index + 1; k < np08->nSamples; k++) {
+      end = k;
+      if (w[k] > NP08Threshold(np08, np08->secondChan)) break;
+    }
+
+    ev->ex_ok[0] = 3;
+    ev->ex_index[0] = (int)pos;
+    ev->ex_interp[0] = (int32_t)dt * NP08_TIME_FRAC + interp;
+    ev->ex_height[0] = height;
+    ev->ex_base[0] = base;
+    ev->ex_endindex[0] = (int)(dt + end);
+    return;
+  }
+}
+
+/****************************************************************************
+* NP08ExtractPulses
+*  One pass over the samples w[0..n-1] of a capture, listing each place the
+*  signal crosses thr going down (the pulses are negative), i.e. w[i] <= thr
+*  with w[i-1] > thr.  For each one it gives
+*    index   i
+*    interp  linearly interpolated crossing time, in 1/NP08_TIME_FRAC ticks
+*    height  lowest value following the descent from i, for at most 10 ticks
+*    base    highest value among w[i-20..i]
+*    end     first tick after i back above thr (n-1 if it never comes back, n if i = n-1)
+*  These are what NP08PeakFind5 used to get with separate searches from each
+*  crossing, for each of its two passes.  Here the scan goes forward once:
+*  it looks for a leading edge, follows the pulse to its end and carries on
+*  from there, so the only samples read twice are the 20 ticks of the base
+*  (still in the cache).  A sliding window maximum updated every tick was
+*  tried for the base, but is much slower on the noisy baseline, where
+*  crossings are rare compared to samples.
+*  pulses[] needs room for n/2 entries, there can't be more crossings than
+*  that.  Returns the number of pulses.
+*
+*  The interpolation is in integers: the fraction of a tick is
+*  (w[i-1] - thr) / (w[i-1] - w[i]), which is in (0,1] at a crossing, and
+*  it is worked out in 1/256 ticks as a multiply by np08Recip[] and a shift
+*  instead of a division.  np08Recip[d] = ceil(2^31/d) is at most 2^31/d + 1,
+*  so with a numerator below 2^24 the product is high by less than 2^-7 of a
+*  1/256 tick before rounding.  The result is therefore the exact fraction
+*  rounded to the nearest 1/256 tick, out by at most 1/512 + 2^-15 tick from
+*  the double calculation used before.  Printed to 0.01 tick, it agrees with
+*  the old %6.2lf output or is 0.01 different when the two roundings
+*  straddle a hundredth.
+****************************************************************************/
+uint32_t np08Recip[65536];   // Filled on first use by NP08ExtractPulses(), np08Recip[d] = ceil(2^31/d)
+
+// Fills p for the leading edge at i (w[i] <= thr < w[i-1]) and returns the first tick after it back above thr, or n
+static __forceinline int32_t NP08PulseAt(const int16_t * w, int32_t n, int16_t thr, int32_t i, NP08PULSE * p)
+{
+  int32_t k, k9;
+  int16_t height, base;
+  uint32_t num, den;
+
+  num = w[i - 1] - thr;     // Both positive, and num <= den as w[i] <= thr < w[i-1]
+  den = w[i - 1] - w[i];
+  p->index = i;
+  p->interp = i * NP08_TIME_FRAC + (int32_t)(((uint64_t)num * NP08_TIME_FRAC * np08Recip[den] + (1ULL << 30)) >> 31);
+
+  // Base is the lowest amplitude tick among the previous 20
+  k9 = i - NP08_BASE_WINDOW;
+  if (k9 < 0) k9 = 0;  // Don't go beyond start of buffer
+  base = w[i];
+  for (k = k9; k < i; k++) {
+    if (w[k] > base) base = w[k];
+  }
+  p->base = base;
+
+  // Peak height, a maximum of 10 samples.  In this comparison, remember the peaks are negative, i.e. '<' means 'higher amplitude'
+  k9 = i + 10;
+  if (k9 > n) k9 = n;
+  height = w[i];
+  for (k = i + 1; k < k9; k++) {
+    if (w[k] < height) height = w[k];
+    else break;    // Stop looking for peak as soon as it starts dipping down
+  }
+  p->height = height;
+
+  // End is where the amplitude goes back below threshold, which is returned
+  for (k = i + 1; k < n; k++) {
+    if (w[k] > thr) break;
+  }
+  if (k < n) p->end = k;
+  else p->end = (i < n - 1) ? n - 1 : n;
+  return k;
+}
+
+int32_t NP08ExtractPulses(int16_t * w, int32_t n, int16_t thr, NP08PULSE * pulses)
+{
+  int32_t i, k, np = 0;
+
+  if (np08Recip[1] == 0) {
+    for (k = 1; k < 65536; k++) np08Recip[k] = (uint32_t)(((1ULL << 31) + k - 1) / k);
+  }
+
+  i = 0;
+  while (i < n && w[i] <= thr) i++;    // Start from above threshold, so the first tick at or below it is a leading edge
+
+  while (i < n) {
+    for (i++; i < n; i++) {            // Look for the leading edge of a pulse
+      if (w[i] <= thr) break;
+    }
+    if (i >= n) break;
+    i = NP08PulseAt(w, n, thr, i, &pulses[np++]);   // The search for the next pulse carries on from its end
+  }
+
+  return np;
+}
+
+/****************************************************************************
+* NP08ExtractPulses8
+*  NP08ExtractPulses() on a capture packed by NP08PackCaptures(), w8 being
+*  the packed samples and w the same ones as they came.  The samples are
+*  256 * w8, and w <= thr exactly when w8 <= thr >> 8, so the leading edges
+*  are found on w8, sixteen ticks to a compare, with half the memory traffic
+*  of the int16 samples.  Each edge is then filled in by NP08PulseAt() from
+*  w, which reads only the few ticks around the pulse, and the list is the
+*  same as from NP08ExtractPulses(w, n, thr).  (As in NP08ExtractBatch(),
+*  every tick at or below thr after one above it starts a pulse.)
+****************************************************************************/
+int32_t NP08ExtractPulses8(const int8_t * w8, const int16_t * w, int32_t n, int16_t thr, NP08PULSE * pulses)
+{
+  int32_t i = 0, k, np = 0;
+  int8_t thr8 = (int8_t)(thr >> 8);
+  int prev = 1;     // Tick i-1 at or below thr, set to start with so tick 0 isn't an edge
+#ifdef NP08_SSE2
+  uint32_t m, e;
+  __m128i thrv = _mm_set1_epi8(thr8);
+#endif
+
+  if (np08Recip[1] == 0) {
+    for (k = 1; k < 65536; k++) np08Recip[k] = (uint32_t)(((1ULL << 31) + k - 1) / k);
+  }
+
+#ifdef NP08_SSE2
+  for (; i + 16 <= n; i += 16) {
+    m = ~_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *)(w8 + i)), thrv)) & 0xffff;   // Bit t: tick i + t at or below thr
+    e = m & ~((m << 1) | prev);
+    prev = m >> 15;
+    for (k = i; e; k++, e >>= 1) {    // Nearly always none, on the baseline
+      if (e & 1) NP08PulseAt(w, n, thr, k, &pulses[np++]);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    if (w8[i] <= thr8) {
+      if (!prev) NP08PulseAt(w, n, thr, i, &pulses[np++]);
+      prev = 1;
+    } else {
+      prev = 0;
+    }
+  }
+
+  return np;
+}
+
+/****************************************************************************
+* NP08ExtractBatch
+*  NP08ExtractPulses() for nlanes (up to NP08_BATCH) captures at once.  The
+*  leading edges, which are all that matter on the quiet baseline, are found
+*  with the captures side by side: each 8x8 block of samples is transposed so
+*  one register holds the same tick of all the captures, and the test
+*  w[i] <= thr < w[i-1] runs on all of them in lockstep, carrying w[i-1] <= thr
+*  from one tick to the next.  Only a block with an edge somewhere in it needs
+*  a look at the lanes, and each edge found is filled in by NP08PulseAt() from
+*  its own capture, as NP08ExtractPulses() would, so the lists are the same.
+*  (Every tick at or below thr with the one before above it is a leading edge
+*  there too: the scan skips only the ticks inside a pulse, which are all at
+*  or below thr.)  w[l] are the samples of lane l, the list of lane l goes in
+*  pulses + l * NP08_MAX_PULSES and its length in np[l].
+****************************************************************************/
+void NP08ExtractBatch(int16_t ** w, int32_t nlanes, int32_t n, int16_t thr, NP08PULSE * pulses, int32_t * np)
+{
+  int32_t l, k;
+#ifdef NP08_SSE2
+  int32_t i, t, m, lanes = (1 << nlanes) - 1, prev;
+  __m128i r[8], b[8], c[8], below, last = _mm_set1_epi16(-1), edge[8], any, thrv = _mm_set1_epi16(thr), ones = _mm_set1_epi16(-1);
+  const int16_t * x[NP08_BATCH];
+
+  if (np08Recip[1] == 0) {
+    for (k = 1; k < 65536; k++) np08Recip[k] = (uint32_t)(((1ULL << 31) + k - 1) / k);
+  }
+  for (l = 0; l < NP08_BATCH; l++) {
+    x[l] = w[(l < nlanes) ? l : 0];    // The spare lanes repeat lane 0 and are masked off
+    np[l] = 0;
+  }
+
+  // last is all ones in the lanes where the previous tick was at or below thr.  It starts all ones, so tick 0 isn't an edge
+  for (i = 0; i + 8 <= n; i += 8) {
+    for (l = 0; l < 8; l++) r[l] = _mm_loadu_si128((const __m128i *)(x[l] + i));
+    b[0] = _mm_unpacklo_epi16(r[0], r[1]); b[1] = _mm_unpackhi_epi16(r[0], r[1]);
+    b[2] = _mm_unpacklo_epi16(r[2], r[3]); b[3] = _mm_unpackhi_epi16(r[2], r[3]);
+    b[4] = _mm_unpacklo_epi16(r[4], r[5]); b[5] = _mm_unpackhi_epi16(r[4], r[5]);
+    b[6] = _mm_unpacklo_epi16(r[6], r[7]); b[7] = _mm_unpackhi_epi16(r[6], r[7]);
+    c[0] = _mm_unpacklo_epi32(b[0], b[2]); c[1] = _mm_unpackhi_epi32(b[0], b[2]);
+    c[2] = _mm_unpacklo_epi32(b[1], b[3]); c[3] = _mm_unpackhi_epi32(b[1], b[3]);
+    c[4] = _mm_unpacklo_epi32(b[4], b[6]); c[5] = _mm_unpackhi_epi32(b[4], b[6]);
+    c[6] = _mm_unpacklo_epi32(b[5], b[7]); c[7] = _mm_unpackhi_epi32(b[5], b[7]);
+    r[0] = _mm_unpacklo_epi64(c[0], c[4]); r[1] = _mm_unpackhi_epi64(c[0], c[4]);   // r[t] is tick i + t of the eight lanes
+    r[2] = _mm_unpacklo_epi64(c[1], c[5]); r[3] = _mm_unpackhi_epi64(c[1], c[5]);
+    r[4] = _mm_unpacklo_epi64(c[2], c[6]); r[5] = _mm_unpackhi_epi64(c[2], c[6]);
+    r[6] = _mm_unpacklo_epi64(c[3], c[7]); r[7] = _mm_unpackhi_epi64(c[3], c[7]);
+
+    any = _mm_setzero_si128();
+    for (t = 0; t < 8; t++) {
+      below = _mm_xor_si128(_mm_cmpgt_epi16(r[t], thrv), ones);
+      edge[t] = _mm_andnot_si128(last, below);
+      any = _mm_or_si128(any, edge[t]);
+      last = below;
+    }
+    if (!(_mm_movemask_epi8(_mm_packs_epi16(any, any)) & lanes)) continue;   // Nearly always, on the baseline
+
+    for (t = 0; t < 8; t++) {
+      m = _mm_movemask_epi8(_mm_packs_epi16(edge[t], edge[t])) & lanes;
+      for (l = 0; m; l++, m >>= 1) {
+	if (m & 1) NP08PulseAt(x[l], n, thr, i + t, pulses + l * NP08_MAX_PULSES + np[l]++);
+      }
+    }
+  }
+
+  // The last few ticks one lane at a time
+  prev = _mm_movemask_epi8(_mm_packs_epi16(last, last));
+  for (l = 0; l < nlanes; l++) {
+    for (k = i; k < n; k++) {
+      if (x[l][k] <= thr) {
+	if (!(prev & (1 << l))) NP08PulseAt(x[l], n, thr, k, pulses + l * NP08_MAX_PULSES + np[l]++);
+	prev |= 1 << l;
+      } else {
+	prev &= ~(1 << l);
+      }
+    }
+  }
+#else
+  for (l = 0; l < nlanes; l++) np[l] = NP08ExtractPulses(w[l], n, thr, pulses + l * NP08_MAX_PULSES);
+  for (; l < NP08_BATCH; l++) np[l] = 0;
+#endif
+}
+
+// Finds the pulses of captures first .. first + NP08_BATCH - 1 on every enabled channel for NP08FindBody()
+void NP08BatchExtract(UNIT * unit, NP08VARS * np08, uint32_t first)
+{
+  int16_t * w[NP08_BATCH];
+  int32_t j, l, nlanes = NP08_BATCH;
+
+  if (first + nlanes > np08->nCapturesM) nlanes = np08->nCapturesM - first;
+  for (j = 0; j < unit->channelCount && j < 4; j++) {
+    if (!unit->channelSettings[j].enabled) continue;
+    if (np08->packMask & (1 << j)) {   // The packed samples are quicker still, one capture at a time
+      for (l = 0; l < nlanes; l++) {
+	np08->batchCount[j][l] = NP08ExtractPulses8(np08->packBuffers[j][first + l], np08->rapidBuffers[j][first + l], np08->nSamples, NP08Threshold(np08, j),
+						    np08->batchPulses + (j * NP08_BATCH + l) * NP08_MAX_PULSES);
+      }
+      continue;
+    }
+    for (l = 0; l < nlanes; l++) w[l] = np08->rapidBuffers[j][first + l];
+    NP08ExtractBatch(w, nlanes, np08->nSamples, NP08Threshold(np08, j), np08->batchPulses + j * NP08_BATCH * NP08_MAX_PULSES, np08->batchCount[j]);
+  }
+  np08->batchFirst = first;
+}
+
+/****************************************************************************
+* Upsampled crossing times for NP08PeakFind5
+*  The linear interpolation between the two samples either side of the
+*  threshold is wrong by up to a few hundredths of a tick where the leading
+*  edge bends.  When np08->upsample is set the signal is rebuilt between
+*  them on a grid of 1/NP08_UP_SUB tick from the NP08_UP_TAPS samples
+*  around them, with a cubic (Keys, a = -0.5, only four of the taps) or a
+*  windowed sinc (Lanczos, a = 4) kernel, and the crossing is taken from
+*  the first grid point at or beyond threshold.  The weights of each grid
+*  point are in a table made once per group (NP08UpTable), and four grid
+*  points are worked out together with SSE2.  Only the crossings of the
+*  pulses found are done, so the cost goes with the number of pulses.
+****************************************************************************/
+
+// table[m][p] is the weight of w[i-4+m] for the value at i-1 + p/NP08_UP_SUB, for kind 1 (cubic) or 2 (windowed sinc)
+void NP08UpTable(float table[][NP08_UP_SUB], int32_t kind)
+{
+  const double pi = 3.14159265358979323846;
+  double x, c[NP08_UP_TAPS], sum;
+  int32_t m, p;
+
+  for (p = 0; p < NP08_UP_SUB; p++) {
+    sum = 0.;
+    for (m = 0; m < NP08_UP_TAPS; m++) {
+      x = fabs((double)p / NP08_UP_SUB + 3 - m);    // Ticks from sample i-4+m
+      if (kind == 1) {
+	if (x < 1.) c[m] = (1.5 * x - 2.5) * x * x + 1.;
+	else if (x < 2.) c[m] = ((-0.5 * x + 2.5) * x - 4.) * x + 2.;
+	else c[m] = 0.;
+      } else {
+	if (x < 1e-9) c[m] = 1.;
+	else if (x < 4.) c[m] = 4. * sin(pi * x) * sin(pi * x / 4.) / (pi * pi * x * x);
+	else c[m] = 0.;
+      }
+      sum += c[m];
+    }
+    for (m = 0; m < NP08_UP_TAPS; m++) table[m][p] = (float)(c[m] / sum);    // So a flat baseline stays flat
+  }
+}
+
+// Crossing time of the pulse found at index (see NP08PULSE) from the upsampled signal, on the same scale as
+// NP08PULSE.interp.  Returns interp as it was if the taps would go outside the capture
+int32_t NP08UpsampleCross(float table[][NP08_UP_SUB], int16_t * w, int32_t n, int32_t index, int16_t thr, int32_t interp)
+{
+  float v[NP08_UP_SUB + 1];
+  const int16_t * x = w + index - 4;
+  int32_t m, p;
+
+  if (index < 4 || index + 4 > n) return interp;
+#ifdef NP08_SSE2
+  for (p = 0; p < NP08_UP_SUB; p += 4) {
+    __m128 acc = _mm_setzero_ps();
+    for (m = 0; m < NP08_UP_TAPS; m++) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(&table[m][p]), _mm_set1_ps((float)x[m])));
+    _mm_storeu_ps(v + p, acc);
+  }
+#else
+  for (p = 0; p < NP08_UP_SUB; p++) {
+    v[p] = 0.f;
+    for (m = 0; m < NP08_UP_TAPS; m++) v[p] += table[m][p] * x[m];
+  }
+#endif
+  v[NP08_UP_SUB] = w[index];
+  for (p = 1; p < NP08_UP_SUB; p++) {
+    if (v[p] <= thr) break;
+  }
+  // v[p-1] is above threshold (v[0] is w[index-1]), so this is a fraction in (0,1] of the grid step
+  return index * NP08_TIME_FRAC + (int32_t)lrintf((p - 1 + (v[p - 1] - thr) / (v[p - 1] - v[p])) * ((float)NP08_TIME_FRAC / NP08_UP_SUB));
+}
+
+/****************************************************************************
+* NP08SplitPileup
+*  Looks for a second pulse close behind one pulse (first, from
+*  NP08ExtractPulses).  That happens when a decay follows within a few
+*  ticks: either it is piled up on the tail with no second crossing, so the
+*  crossing search can't see it, or it crosses again but is thrown out by
+*  np08->secondMinDelay, and in both cases its height is wrong as it sits on
+*  the tail of the first.  The criterion is on the slopes: after the first
+*  peak the signal has to recover by at least dip ADC counts and then fall
+*  again by at least dip, or, once it is back above threshold, fall below
+*  thr again.  Only the first NP08_PILE_MAX ticks after the crossing are
+*  looked at, so the cost per pulse is bounded.
+*  The two amplitudes are then separated with a least squares fit of
+*    y = base + A1 s(t - t1) + A2 s(t - t2)
+*  where s is the pulse shape in shape[] (see NP08PileShape) and t1, t2 are
+*  put so the shape peaks are at the two observed peaks, which leaves a 2x2
+*  linear problem.  If A2 is a pulse bigger than dip the second pulse goes
+*  in second (index = where the signal starts falling again, and the time
+*  that turning point interpolated between the ticks, height = base + A2),
+*  first with height = base + A1 goes in split1, and it returns 1,
+*  otherwise 0.
+****************************************************************************/
+#define NP08_PILE_MAX 48       // Ticks after the crossing searched for a second pulse
+#define NP08_PILE_SHAPE 128    // Length of the shape table, more than NP08_PILE_MAX + 4 rise times
+
+// Pulse shape for the pile-up fit, x/rise exp(1 - x/rise), peak 1 at x = rise (negative pulses have A < 0)
+void NP08PileShape(float * shape, int32_t rise)
+{
+  int32_t x;
+  for (x = 0; x < NP08_PILE_SHAPE; x++) shape[x] = (float)((double)x / rise * exp(1. - (double)x / rise));
+}
+
+int NP08SplitPileup(int16_t * w, int32_t n, int16_t thr, NP08PULSE * first, int32_t dip, const float * shape, int32_t rise,
+		    NP08PULSE * split1, NP08PULSE * second)
+{
+  int32_t k, kmax, k1, kv, k2, t1, t2, lo, hi, v;
+  int16_t vmax = 0;
+  float s1, s2, y, S11 = 0.f, S12 = 0.f, S22 = 0.f, R1 = 0.f, R2 = 0.f, det, A1, A2, c, d;
+
+  kmax = first->index + NP08_PILE_MAX;
+  if (kmax > n) kmax = n;
+
+  // First peak, then a recovery by dip (kv = highest point after it), then a fall by dip
+  k1 = first->index;
+  kv = -1;
+  for (k = first->index + 1; k < kmax; k++) {
+    if (kv < 0) {
+      if (w[k] < w[k1]) k1 = k;                                  // Still going down to the first peak
+      else if (w[k] >= w[k1] + dip) { kv = k; vmax = w[k]; }     // Recovered enough
+    } else {
+      if (w[k] > vmax) { kv = k; vmax = w[k]; }
+      else if (w[k] <= vmax - dip && (k < first->end || w[k] <= thr)) break;   // Second pulse (just noise if it doesn't cross once the first has ended)
+    }
+  }
+  if (k >= kmax) return 0;
+
+  k2 = k;     // Second peak
+  while (k2 + 1 < n && w[k2 + 1] < w[k2]) k2++;
+
+  // Fit the two amplitudes
+  t1 = k1 - rise;
+  t2 = k2 - rise;
+  lo = (t1 > 0) ? t1 : 0;
+  hi = k2 + 2 * rise + 1;
+  if (hi > n) hi = n;
+  if (hi - t1 > NP08_PILE_SHAPE) hi = t1 + NP08_PILE_SHAPE;
+  for (k = lo; k < hi; k++) {
+    s1 = shape[k - t1];
+    s2 = (k >= t2) ? shape[k - t2] : 0.f;
+    y = (float)(w[k] - first->base);
+    S11 += s1 * s1; S12 += s1 * s2; S22 += s2 * s2;
+    R1 += s1 * y;   R2 += s2 * y;
+  }
+  det = S11 * S22 - S12 * S12;
+  if (det <= 1e-3f * S11 * S22) return 0;    // The two shapes are too alike to separate
+  A2 = (R2 * S11 - R1 * S12) / det;
+  if (A2 > -dip) return 0;                    // No real second pulse (remember pulses are negative)
+  A1 = (R1 * S22 - R2 * S12) / det;
+
+  *split1 = *first;
+  v = first->base + (int32_t)lrintf(A1);
+  split1->height = (v < -32768) ? -32768 : (v > 32767) ? 32767 : v;
+
+  // The top of the recovery from the parabola through the three ticks around it
+  d = 0.f;
+  c = (float)w[kv - 1] - 2.f * w[kv] + ((kv + 1 < n) ? w[kv + 1] : w[kv]);
+  if (c < 0.f) {
+    d = 0.5f * ((float)w[kv - 1] - ((kv + 1 < n) ? w[kv + 1] : w[kv])) / c;
+    if (d < -0.5f) d = -0.5f;
+    if (d > 0.5f) d = 0.5f;
+  }
+  v = first->base + (int32_t)lrintf(A2);
+  second->index = kv;
+  second->interp = kv * NP08_TIME_FRAC + (int32_t)lrintf(d * NP08_TIME_FRAC);
+  second->height = (v < -32768) ? -32768 : v;
+  second->base = first->base;
+  second->end = first->end;
+  if (k2 >= first->end) {      // Separate crossing, find its own end
+    for (second->end = k2 + 1; second->end < n; second->end++) {
+      if (w[second->end] > thr) break;
+    }
+  }
+  return 1;
+}
+
+/****************************************************************************
+* Charge integrals for NP08PeakFind5
+*  The charge is a better measure of the energy left in the scintillator than
+*  the peak height, and the fraction of it that arrives early tells pulse
+*  shapes apart.  When np08->chargeTotal is set, each pulse gets its prompt
+*  charge, over ticks chargeStart to chargePrompt from its crossing, and its
+*  total charge, over chargeStart to chargeTotal, both below the mean of the
+*  NP08_BASE_WINDOW ticks before the windows.  The samples of a channel are
+*  summed once (NP08PrefixSum), after which each sum over a window is the
+*  difference of two of the prefix sums, whatever the window lengths.
+****************************************************************************/
+
+// P[i] = w[0] + ... + w[i - 1] for i = 0 .. n
+void NP08PrefixSum(int16_t * w, int32_t n, int32_t * P)
+{
+  int32_t i;
+
+  P[0] = 0;
+  for (i = 0; i < n; i++) P[i + 1] = P[i] + w[i];
+}
+
+// Charges of the pulse crossing at index, from the prefix sums P of the n samples.  Returns 0 if the windows don't fit in the capture
+int NP08Charge(NP08VARS * np08, int32_t * P, int32_t n, int32_t index, int * prompt, int * total)
+{
+  int32_t a = index + np08->chargeStart, bp = index + np08->chargePrompt, bt = index + np08->chargeTotal;
+  double base;
+
+  if (a - NP08_BASE_WINDOW < 0 || bt > n) return 0;
+  base = (double)(P[a] - P[a - NP08_BASE_WINDOW]) / NP08_BASE_WINDOW;
+  *prompt = (int)lrint(base * (bp - a) - (P[bp] - P[a]));    // Pulses are negative, so charges below the base are positive
+  *total = (int)lrint(base * (bt - a) - (P[bt] - P[a]));
+  return 1;
+}
+
+/****************************************************************************
+* NP08PeakFind5 pulse finding kernels
+*  NP08FindBody() finds the pulses of one capture for NP08PeakFind5: on each
+*  enabled channel the main pulse closest to the trigger (A1 B1 C1 D1), and on
+*  np08->secondChan the np08->exKeep biggest pulses by np08->exKey (B3 B4 B5
+*  B6 ...), sorted into ex_ slots 1..nex.  The results go in ev (ok, index,
+*  interp, height and the ex_ arrays).  The extra pulses are kept in a min-heap
+*  whose root is the smallest kept, so once it is full a crossing costs one
+*  compare, and log2(exKeep) more if it replaces the root.
+*  It is always inlined, so each NP08_FIND_KERNEL() below is a copy compiled
+*  for a fixed channel count and enabled-channel mask, with the channel loop
+*  unrolled and no test of channelSettings[].enabled.  NP08PickKernel() picks
+*  one per group from the scope setup; NP08FindGeneric() is the version that
+*  works for any setup (and was the only one before), kept for comparison in
+*  NP08BenchKernels().
+****************************************************************************/
+typedef void (*NP08FINDKERNEL)(UNIT* unit, NP08VARS* np08, uint32_t capture, NP08EVENT* ev);
+
+// Order of the min-heap of NP08FindBody(): smaller key, or the same key and later in the capture (larger pulse list index)
+#define NP08_HEAP_LESS(ka, pa, kb, pb) ((ka) < (kb) || ((ka) == (kb) && (pa) > (pb)))
+
+// Moves element i of the min-heap key[] (pos[] goes with it) of n elements down to its place
+static __forceinline void NP08HeapDown(int * key, int * pos, int n, int i)
+{
+  int c, k = key[i], p = pos[i];
+
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n && NP08_HEAP_LESS(key[c + 1], pos[c + 1], key[c], pos[c])) c++;   // The smaller child
+    if (!NP08_HEAP_LESS(key[c], pos[c], k, p)) break;
+    key[i] = key[c];
+    pos[i] = pos[c];
+    i = c;
+  }
+  key[i] = k;
+  pos[i] = p;
+}
+
+// Empties extra pulse slot j
+static __forceinline void NP08ExClear(NP08EVENT * ev, int j)
+{
+  ev->ex_ok[j] = 0;
+  ev->ex_index[j] = 0;
+  ev->ex_height[j] = 0;
+  ev->ex_interp[j] = 0;
+  ev->ex_base[j] = 0;
+  ev->ex_endindex[j] = 0;
+  ev->ex_hb[j] = 0;
+  ev->ex_qPrompt[j] = 0;
+  ev->ex_qTotal[j] = 0;
+}
+
+static __forceinline void NP08FindBody(NP08VARS* np08, uint32_t capture, NP08EVENT* ev, const int nchan, const int mask)
+{
+  NP08PULSE pulses[NP08_MAX_PULSES];   // Threshold crossings on one channel
+  NP08PULSE * pl;                      // pulses[], or the list of this capture from NP08BatchExtract()
+  int32_t nPulses, ip, j, k;
+  int close, dist, dist1, lastpeak, isel;
+  int hb1, key, nkeep, nheap, q;
+  int hkey[NP08_EX_MAX], hpos[NP08_EX_MAX];   // The heap of extra pulses, key and index in pl[]
+  int32_t prefix[NP08_MAX_SAMPLES + 1];       // Prefix sums of secondChan when they are chosen by charge
+
+  nkeep = (np08->exKeep < 1) ? 1 : (np08->exKeep > NP08_EX_MAX) ? NP08_EX_MAX : np08->exKeep;
+  for (j = 0; j < 4; j++) {  // First zero everything
+    ev->index[j] = np08->nPreSamples;
+    ev->height[j] = 0;
+    ev->base[j] = 0;
+
+    ev->interp[j] = 0;
+    ev->ok[j] = 0;
+    ev->fitOk[j] = 0;
+    ev->fitAmp[j] = 0;
+    ev->fitTime[j] = 0;
+    ev->fitChi2[j] = 0.f;
+    ev->qPrompt[j] = 0;
+    ev->qTotal[j] = 0;
+  }
+  for (j = 0; j <= NP08_EX_MAX; j++) NP08ExClear(ev, j);   // All of them, NP08WriteEvent() writes slots 0..3 whatever exKeep is
+  ev->nex = 0;
+  ev->pileOk = 0;
+  memset(&ev->pile, 0, sizeof(ev->pile));
+  memset(&ev->pileFirst, 0, sizeof(ev->pileFirst));
+  if (np08->coincCount > 0) memset(np08->coincMask, 0, sizeof(np08->coincMask));
+  if (np08->zsFile != NULL) memset(np08->zsMask, 0, sizeof(np08->zsMask));
+
+  // The pulse list is used both for the A1 B1 C1 D1 pulses and, on np08->secondChan, for the B3 B4 B5 B6 pulses.  The
+  // two selections act independently, i.e. there are no times or pulse heights used in one that are needed in the other.
+  for (j = 0; j < nchan; j++) {    // We do this procedure on each channel
+    if (!(mask & (1 << j))) continue;   // Don't find any peaks if channel is disabled.
+
+    if (np08->batchFirst >= 0 && (int32_t)capture - np08->batchFirst >= 0 && (int32_t)capture - np08->batchFirst < NP08_BATCH) {
+      pl = np08->batchPulses + (j * NP08_BATCH + capture - np08->batchFirst) * NP08_MAX_PULSES;   // Found with its block, see NP08BatchExtract()
+      nPulses = np08->batchCount[j][capture - np08->batchFirst];
+    } else {
+      pl = pulses;
+      if (np08->packMask & (1 << j)) nPulses = NP08ExtractPulses8(np08->packBuffers[j][capture], np08->rapidBuffers[j][capture], np08->nSamples, NP08Threshold(np08, j), pulses);
+      else nPulses = NP08ExtractPulses(np08->rapidBuffers[j][capture], np08->nSamples, NP08Threshold(np08, j), pulses);
+    }
+    if (np08->coincCount > 0) {   // All the crossings go in the coincidence mask
+      for (ip = 0; ip < nPulses; ip++) np08->coincMask[j][pl[ip].index >> 6] |= 1ULL << (pl[ip].index & 63);
+    }
+    if (np08->zsFile != NULL) {   // The samples around every pulse are kept
+      for (ip = 0; ip < nPulses; ip++) NP08MaskRange(np08->zsMask, pl[ip].index - np08->zsPre, pl[ip].end + np08->zsPost + 1, np08->nSamples);
+    }
+
+    // This section finds the A1 B1 C1 D1 pulses (was B1, A1, C1 and B2 pulses (B2 was useless)), the one closest to the trigger
+    close = np08->nPreSamples;   // Start searching from the trigger time
+    dist = np08->nSamples * 2;   // How close are we, start way out.
+    lastpeak = -5;               // Last pulse looked at, to ensure a gap of 5 ticks
+    isel = -1;
+    for (ip = 0; ip < nPulses; ip++) {
+      if (pl[ip].index - lastpeak < 5) continue;     // Skip if we are close to previous peak
+      lastpeak = pl[ip].index;
+
+      // TODO:  Insert CFD in here
+
+      dist1 = pl[ip].index - close;
+      if (dist1 < 0) dist1 = -dist1;  // abs(dist1)
+      if (dist1 < dist) { ev->index[j] = pl[ip].index; ev->interp[j] = pl[ip].interp;  ev->height[j] = pl[ip].height;  ev->base[j] = pl[ip].base;  ev->ok[j] = 1; dist = dist1; isel = ip; }    // Closer than others, accept
+    }
+
+    // This section finds the B3, B4, B5, B6 ... pulses, keeping the top nkeep by np08->exKey.  They go in slots 1..nex,
+    // biggest first, and NP08PeakFind5 then moves the most favoured pulse to slot 0 using the same algorithm as
+    // PeakFinder4 used in 2020 & TT2021 for the B3 pulse.
+    if (j != np08->secondChan) continue;   // Was fixed to CHANNEL_B, a value of -1 disables secondary peak finding
+
+    // A decay piled up on the main pulse, see NP08SplitPileup()
+    if (np08->pileDip > 0 && isel >= 0) {
+      ev->pileOk = NP08SplitPileup(np08->rapidBuffers[j][capture], np08->nSamples, NP08Threshold(np08, j), &pl[isel], np08->pileDip,
+				   np08->pileShape, np08->pileRise, &ev->pileFirst, &ev->pile);
+    }
+
+    key = np08->exKey;
+    if (key == 1 && np08->chargeTotal <= 0) key = 0;   // Charges off, use height - base
+    if (key == 1) NP08PrefixSum(np08->rapidBuffers[j][capture], np08->nSamples, prefix);
+    nheap = 0;
+    for (ip = 0; ip < nPulses; ip++) {
+      hb1 = -(pl[ip].height - pl[ip].base);    // Postive number, the bigger number is the bigger pulse
+      if (hb1 <= 0) continue;                          // Not a pulse
+      if (key == 1) {
+	if (!NP08Charge(np08, prefix, np08->nSamples, pl[ip].index, &q, &hb1)) hb1 = -0x7FFFFFFF;   // Windows out of the capture, last
+      } else if (key == 2) {
+	hb1 = -pl[ip].index;
+      }
+
+      if (nheap < nkeep) {              // Still room, add it at the bottom and move it up
+	for (k = nheap++; k > 0 && NP08_HEAP_LESS(hb1, ip, hkey[(k - 1) / 2], hpos[(k - 1) / 2]); k = (k - 1) / 2) {
+	  hkey[k] = hkey[(k - 1) / 2];
+	  hpos[k] = hpos[(k - 1) / 2];
+	}
+	hkey[k] = hb1;
+	hpos[k] = ip;
+      } else if (hb1 > hkey[0]) {       // Bigger than the smallest one kept, replace it (on a tie the earlier one stays)
+	hkey[0] = hb1;
+	hpos[0] = ip;
+	NP08HeapDown(hkey, hpos, nheap, 0);
+      }
+    }
+
+    // Take the smallest off the heap each time, so the slots fill from the end
+    ev->nex = nheap;
+    for (k = nheap; k > 0; k--) {
+      ip = hpos[0];
+      ev->ex_ok[k] = 1;
+      ev->ex_index[k] = pl[ip].index;
+      ev->ex_interp[k] = pl[ip].interp;
+      ev->ex_height[k] = pl[ip].height;
+      ev->ex_base[k] = pl[ip].base;
+      ev->ex_hb[k] = -(pl[ip].height - pl[ip].base);
+      ev->ex_endindex[k] = pl[ip].end;
+      nheap--;
+      hkey[0] = hkey[nheap];
+      hpos[0] = hpos[nheap];
+      NP08HeapDown(hkey, hpos, nheap, 0);
+    }
+  }   // End of loop over scope channels
+}
+
+// Any channel count and enabled channels, looked up for every capture
+void NP08FindGeneric(UNIT* unit, NP08VARS* np08, uint32_t capture, NP08EVENT* ev)
+{
+  int j, mask = 0;
+  for (j = 0; j < unit->channelCount && j < 4; j++) {
+    if (unit->channelSettings[j].enabled) mask |= 1 << j;
+  }
+  NP08FindBody(np08, capture, ev, (unit->channelCount < 4) ? unit->channelCount : 4, mask);
+}
+
+#define NP08_FIND_KERNEL(NCHAN, MASK) \
+void NP08FindKernel_##NCHAN##_##MASK(UNIT* unit, NP08VARS* np08, uint32_t capture, NP08EVENT* ev) \
+{ \
+  (void)unit;   /* The setup is compiled in */ \
+  NP08FindBody(np08, capture, ev, NCHAN, MASK); \
+}
+
+NP08_FIND_KERNEL(2, 1)  NP08_FIND_KERNEL(2, 2)  NP08_FIND_KERNEL(2, 3)
+NP08_FIND_KERNEL(4, 1)  NP08_FIND_KERNEL(4, 2)  NP08_FIND_KERNEL(4, 3)  NP08_FIND_KERNEL(4, 4)  NP08_FIND_KERNEL(4, 5)
+NP08_FIND_KERNEL(4, 6)  NP08_FIND_KERNEL(4, 7)  NP08_FIND_KERNEL(4, 8)  NP08_FIND_KERNEL(4, 9)  NP08_FIND_KERNEL(4, 10)
+NP08_FIND_KERNEL(4, 11) NP08_FIND_KERNEL(4, 12) NP08_FIND_KERNEL(4, 13) NP08_FIND_KERNEL(4, 14) NP08_FIND_KERNEL(4, 15)
+
+// Indexed by the enabled-channel mask (bit 0 = channel A)
+NP08FINDKERNEL np08Kernels2[4] = { NP08FindGeneric, NP08FindKernel_2_1, NP08FindKernel_2_2, NP08FindKernel_2_3 };
+NP08FINDKERNEL np08Kernels4[16] = { NP08FindGeneric, NP08FindKernel_4_1, NP08FindKernel_4_2, NP08FindKernel_4_3,
+				    NP08FindKernel_4_4, NP08FindKernel_4_5, NP08FindKernel_4_6, NP08FindKernel_4_7,
+				    NP08FindKernel_4_8, NP08FindKernel_4_9, NP08FindKernel_4_10, NP08FindKernel_4_11,
+				    NP08FindKernel_4_12, NP08FindKernel_4_13, NP08FindKernel_4_14, NP08FindKernel_4_15 };
+
+// Choose the kernel for the current scope setup, once per group
+NP08FINDKERNEL NP08PickKernel(UNIT* unit)
+{
+  int j, mask = 0;
+  for (j = 0; j < unit->channelCount && j < 4; j++) {
+    if (unit->channelSettings[j].enabled) mask |= 1 << j;
+  }
+  if (unit->channelCount == 2) return np08Kernels2[mask];
+  if (unit->channelCount == 4) return np08Kernels4[mask];
+  return NP08FindGeneric;
+}
+
+/****************************************************************************
+* Template fit of the main pulses for NP08PeakFind5
+*  The time and height from the threshold crossing depend on the noise on
+*  the one or two samples around it, and the crossing time walks with the
+*  pulse height.  When np08->fitLearn is set, the first fitLearn accepted
+*  pulses of each channel are normalised to height 1 and averaged, lined up
+*  on the time they reach half their height (NP08HalfTime), into a template
+*  on a grid of 1/NP08_FIT_SUB tick (NP08TemplateAdd).  From then on each
+*  main pulse is fitted over NP08_FIT_LEN ticks around its half height time
+*  t0 by
+*    y = b + A T(t - t0) + C T'(t - t0),
+*  which is the template moved by dt = -C/A to first order.  The template
+*  and its slope are stored pre-shifted to each sub-tick phase and the
+*  normal matrix of each phase is inverted once (NP08TemplateMake), so a fit
+*  is the three sums of y, y T and y T' over the window and a 3x3 multiply.
+*  It is done twice, the second time at the phase of the moved time.
+*  NP08FitPulse() gives the amplitude A, the time t0 + dt (when the fitted
+*  pulse is at half height) and the sum of squared residuals per degree of
+*  freedom.
+****************************************************************************/
+
+// Time in ticks at which the pulse found at index (see NP08PULSE) reaches half way from base to height
+double NP08HalfTime(int16_t * w, int32_t n, int32_t index, int32_t base, int32_t height)
+{
+  int32_t k = index, half = (base + height) / 2;
+
+  while (k + 1 < n && w[k] > half) k++;         // Forward if the crossing is above half height
+  while (k > 0 && w[k - 1] <= half) k--;         // or back if it is below
+  if (k == 0 || w[k] > half) return (double)k;
+  return k - 1 + (double)(w[k - 1] - half) / (w[k - 1] - w[k]);
+}
+
+// Add the pulse found at index (see NP08PULSE) to the template being learnt
+void NP08TemplateAdd(NP08TEMPLATE * tp, int16_t * w, int32_t n, int32_t index, int32_t base, int32_t height)
+{
+  int32_t i0, s, p, k;
+  double t = NP08HalfTime(w, n, index, base, height), a = (double)(base - height);
+
+  i0 = (int32_t)floor(t) + 1;
+  p = (int32_t)lrint((i0 - t) * NP08_FIT_SUB);
+  s = i0 - NP08_FIT_PRE;
+  if (a <= 0. || s < 0 || s + NP08_FIT_LEN > n) return;
+  for (k = 0; k < NP08_FIT_LEN; k++) {
+    tp->sum[k * NP08_FIT_SUB + p] += (w[s + k] - base) / a;
+    tp->count[k * NP08_FIT_SUB + p]++;
+  }
+  tp->nLearnt++;
+}
+
+// Make the template from the pulses added, and the tables for the fit.  Returns 1 if it worked
+int NP08TemplateMake(NP08TEMPLATE * tp)
+{
+  double T[NP08_FIT_LEN * NP08_FIT_SUB + 1], D[NP08_FIT_LEN * NP08_FIT_SUB + 1], m[9], c[9], det, zero, tmin = 0.;
+  int32_t nb = NP08_FIT_LEN * NP08_FIT_SUB + 1, b, b0, b1, p, k, i;
+
+  // Average, with the empty bins filled in from their neighbours, and with the first tick (before the pulse) as zero
+  b0 = -1;
+  for (b = 0; b < nb; b++) {
+    if (tp->count[b] == 0) continue;
+    T[b] = tp->sum[b] / tp->count[b];
+    for (b1 = b0 + 1; b1 < b; b1++) T[b1] = (b0 < 0) ? T[b] : T[b0] + (T[b] - T[b0]) * (b1 - b0) / (b - b0);
+    b0 = b;
+  }
+  if (b0 < 0) return 0;
+  for (b1 = b0 + 1; b1 < nb; b1++) T[b1] = T[b0];
+  for (b = 0, zero = 0.; b < NP08_FIT_SUB; b++) zero += T[b] / NP08_FIT_SUB;
+  for (b = 0; b < nb; b++) T[b] -= zero;
+  for (b = 0; b < nb; b++) if (T[b] < tmin) tmin = T[b];
+  if (tmin >= 0.) return 0;
+  for (b = 0; b < nb; b++) T[b] /= -tmin;    // Peak at -1, so A is the height
+  for (b = 0; b < nb; b++) {
+    if (b == 0) D[b] = (T[1] - T[0]) * NP08_FIT_SUB;
+    else if (b == nb - 1) D[b] = (T[b] - T[b - 1]) * NP08_FIT_SUB;
+    else D[b] = (T[b + 1] - T[b - 1]) * NP08_FIT_SUB / 2.;
+  }
+
+  for (p = 0; p <= NP08_FIT_SUB; p++) {
+    for (i = 0; i < 9; i++) m[i] = 0.;
+    for (k = 0; k < NP08_FIT_LEN; k++) {
+      b = k * NP08_FIT_SUB + p;
+      tp->t[p][k] = (float)T[b];
+      tp->d[p][k] = (float)D[b];
+      m[0] += 1.;          m[1] += T[b];          m[2] += D[b];
+      m[4] += T[b] * T[b]; m[5] += T[b] * D[b];   m[8] += D[b] * D[b];
+    }
+    m[3] = m[1]; m[6] = m[2]; m[7] = m[5];
+    c[0] = m[4] * m[8] - m[5] * m[7];  c[1] = m[2] * m[7] - m[1] * m[8];  c[2] = m[1] * m[5] - m[2] * m[4];
+    c[3] = m[5] * m[6] - m[3] * m[8];  c[4] = m[0] * m[8] - m[2] * m[6];  c[5] = m[2] * m[3] - m[0] * m[5];
+    c[6] = m[3] * m[7] - m[4] * m[6];  c[7] = m[1] * m[6] - m[0] * m[7];  c[8] = m[0] * m[4] - m[1] * m[3];
+    det = m[0] * c[0] + m[1] * c[3] + m[2] * c[6];
+    if (det <= 0.) return 0;
+    for (i = 0; i < 9; i++) tp->inv[p][i] = (float)(c[i] / det);
+  }
+  tp->ready = 1;
+  return 1;
+}
+
+// Sums of y, y t and y d over the window (y = w - base), and of the squared residuals of y - (b + A t + C d) if r2 is given
+static __forceinline void NP08FitSums(const int16_t * w, int32_t base, const float * t, const float * d, float * r, const float * fit, float * r2)
+{
+  int32_t k;
+#ifdef NP08_SSE2
+  __m128 sy = _mm_setzero_ps(), st = _mm_setzero_ps(), sd = _mm_setzero_ps(), se = _mm_setzero_ps(), vy, ve, vt, vd;
+  __m128i vbase = _mm_set1_epi32(base);
+  float h[4];
+
+  for (k = 0; k < NP08_FIT_LEN; k += 4) {
+    vy = _mm_cvtepi32_ps(_mm_sub_epi32(NP08_LOAD4(w + k), vbase));
+    vt = _mm_loadu_ps(t + k);
+    vd = _mm_loadu_ps(d + k);
+    if (r2) {
+      ve = _mm_sub_ps(vy, _mm_add_ps(_mm_set1_ps(fit[0]), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(fit[1]), vt), _mm_mul_ps(_mm_set1_ps(fit[2]), vd))));
+      se = _mm_add_ps(se, _mm_mul_ps(ve, ve));
+    } else {
+      sy = _mm_add_ps(sy, vy);
+      st = _mm_add_ps(st, _mm_mul_ps(vy, vt));
+      sd = _mm_add_ps(sd, _mm_mul_ps(vy, vd));
+    }
+  }
+  if (r2) {
+    _mm_storeu_ps(h, se); *r2 = (h[0] + h[1]) + (h[2] + h[3]);
+  } else {
+    _mm_storeu_ps(h, sy); r[0] = (h[0] + h[1]) + (h[2] + h[3]);
+    _mm_storeu_ps(h, st); r[1] = (h[0] + h[1]) + (h[2] + h[3]);
+    _mm_storeu_ps(h, sd); r[2] = (h[0] + h[1]) + (h[2] + h[3]);
+  }
+#else
+  float y, e;
+
+  if (r2) *r2 = 0.f; else r[0] = r[1] = r[2] = 0.f;
+  for (k = 0; k < NP08_FIT_LEN; k++) {
+    y = (float)(w[k] - base);
+    if (r2) {
+      e = y - (fit[0] + fit[1] * t[k] + fit[2] * d[k]);
+      *r2 += e * e;
+    } else {
+      r[0] += y; r[1] += y * t[k]; r[2] += y * d[k];
+    }
+  }
+#endif
+}
+
+// Fit the pulse found at index (see NP08PULSE) in the n samples of w.  Returns 1 if it worked
+int NP08FitPulse(NP08TEMPLATE * tp, int16_t * w, int32_t n, int32_t index, int32_t base, int32_t height, int * amp, int32_t * time, float * chi2)
+{
+  int32_t i0, s, p, it, i;
+  double t = NP08HalfTime(w, n, index, base, height), dt = 0.;
+  float r[3], fit[3], r2;
+
+  for (it = 0; it < 2; it++) {
+    i0 = (int32_t)floor(t) + 1;
+    p = (int32_t)lrint((i0 - t) * NP08_FIT_SUB);
+    s = i0 - NP08_FIT_PRE;
+    if (s < 0 || s + NP08_FIT_LEN > n) return 0;
+    NP08FitSums(w + s, base, tp->t[p], tp->d[p], r, NULL, NULL);
+    for (i = 0; i < 3; i++) fit[i] = tp->inv[p][3 * i] * r[0] + tp->inv[p][3 * i + 1] * r[1] + tp->inv[p][3 * i + 2] * r[2];
+    if (fit[1] <= 0.f) return 0;            // Not a pulse
+    dt = -fit[2] / fit[1];
+    if (dt > 1.) dt = 1.;                   // Only good to first order, it gets another go
+    if (dt < -1.) dt = -1.;
+    t = i0 - (double)p / NP08_FIT_SUB + dt;
+  }
+  NP08FitSums(w + s, base, tp->t[p], tp->d[p], NULL, fit, &r2);
+  *amp = (int)lrintf(fit[1]);
+  *time = (int32_t)lrint(t * NP08_TIME_FRAC);
+  *chi2 = r2 / (NP08_FIT_LEN - 3);
+  return 1;
+}
+
+/****************************************************************************
+* Averaged pulse shapes for NP08PeakFind5
+*  With np08->avgGroups set, each accepted pulse is added into a sum, and a
+*  sum of squares, of its NP08_AVG_LEN samples around the crossing, after
+*  taking off its baseline.  The pulses are aligned on the tick of their
+*  interpolated time and summed in one of NP08_AVG_SUB rows by the fraction
+*  of a tick, so the rows interleaved give the shape at 1/NP08_AVG_SUB tick
+*  steps.  Every avgGroups groups NP08Loop writes the mean and RMS shapes to
+*  the side file and starts again, which gives the pulse shapes for a small
+*  fraction of the size of writing the waveforms of each record.
+****************************************************************************/
+
+// Adds the pulse of the n samples w crossing at interp (1/NP08_TIME_FRAC ticks).  Returns 0 if it is too near an end
+int NP08AverageAdd(NP08AVERAGE * av, const int16_t * w, int32_t n, int32_t interp)
+{
+  int32_t s = interp / NP08_TIME_FRAC - NP08_AVG_PRE, p = (interp % NP08_TIME_FRAC) * NP08_AVG_SUB / NP08_TIME_FRAC, k;
+  double base = 0., * sum, * sum2;
+
+  if (interp < 0 || s < 0 || s + NP08_AVG_LEN > n) return 0;
+  for (k = 0; k < NP08_AVG_BASE; k++) base += w[s + k];
+  base /= NP08_AVG_BASE;
+  sum = av->sum[p];
+  sum2 = av->sum2[p];
+#ifdef NP08_SSE2
+  {
+    __m128d b = _mm_set1_pd(base), lo, hi;
+    __m128i v;
+    for (k = 0; k < NP08_AVG_LEN; k += 4) {
+      v = NP08_LOAD4(w + s + k);
+      lo = _mm_sub_pd(_mm_cvtepi32_pd(v), b);
+      hi = _mm_sub_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, 0xEE)), b);
+      _mm_storeu_pd(sum + k, _mm_add_pd(_mm_loadu_pd(sum + k), lo));
+      _mm_storeu_pd(sum + k + 2, _mm_add_pd(_mm_loadu_pd(sum + k + 2), hi));
+      _mm_storeu_pd(sum2 + k, _mm_add_pd(_mm_loadu_pd(sum2 + k), _mm_mul_pd(lo, lo)));
+      _mm_storeu_pd(sum2 + k + 2, _mm_add_pd(_mm_loadu_pd(sum2 + k + 2), _mm_mul_pd(hi, hi)));
+    }
+  }
+#else
+  {
+    double x;
+    for (k = 0; k < NP08_AVG_LEN; k++) {
+      x = w[s + k] - base;
+      sum[k] += x;
+      sum2[k] += x * x;
+    }
+  }
+#endif
+  av->n[p]++;
+  return 1;
+}
+
+// Writes the averaged shapes to file and clears them.  One line per channel and category with pulses:
+//   group,category,channel,NP08_AVG_SUB x (pulses in row),NP08_AVG_LEN*NP08_AVG_SUB x (mean),NP08_AVG_LEN*NP08_AVG_SUB x (RMS)
+// Point m of the shapes is (m + 0.5) / NP08_AVG_SUB - NP08_AVG_PRE - 1 ticks from the time in the record, in ADC counts from the baseline
+void NP08AverageFlush(UNIT * unit, NP08VARS * np08, FILE * file, uint32_t group)
+{
+  NP08AVERAGE * av;
+  int32_t cat, j, m, k, p;
+  double mean[NP08_AVG_LEN * NP08_AVG_SUB], rms[NP08_AVG_LEN * NP08_AVG_SUB];
+
+  for (cat = 0; cat < NP08_AVG_CATS; cat++) {
+    for (j = 0; j < unit->channelCount && j < 4; j++) {
+      av = &np08->avg[cat][j];
+      for (p = 0; p < NP08_AVG_SUB && av->n[p] == 0; p++);
+      if (p == NP08_AVG_SUB) continue;    // Nothing summed
+
+      for (m = 0; m < NP08_AVG_LEN * NP08_AVG_SUB; m++) {
+	k = m / NP08_AVG_SUB;
+	p = NP08_AVG_SUB - 1 - m % NP08_AVG_SUB;   // Later in the tick crossing, earlier point
+	mean[m] = rms[m] = 0.;
+	if (av->n[p] == 0) continue;
+	mean[m] = av->sum[p][k] / av->n[p];
+	rms[m] = av->sum2[p][k] / av->n[p] - mean[m] * mean[m];
+	rms[m] = (rms[m] > 0.) ? sqrt(rms[m]) : 0.;
+      }
+      fprintf(file, "%d,%d,%d", group, cat, j);
+      for (p = 0; p < NP08_AVG_SUB; p++) fprintf(file, ",%d", av->n[p]);
+      for (m = 0; m < NP08_AVG_LEN * NP08_AVG_SUB; m++) fprintf(file, ",%.1f", mean[m]);
+      for (m = 0; m < NP08_AVG_LEN * NP08_AVG_SUB; m++) fprintf(file, ",%.1f", rms[m]);
+      fprintf(file, "\n");
+    }
+  }
+  memset(np08->avg, 0, sizeof(np08->avg));
+}
+
+/****************************************************************************
+* NP08WriteZS
+*  With np08->zsMode set, NP08Loop() opens runD_XXXXXX_zs.dat and the
+*  captures that pass cut2 (the record cut is not applied) have the samples
+*  around their pulses written there, instead of the whole capture.  Every
+*  pulse on an enabled channel keeps the ticks from zsPre before its
+*  crossing to zsPost after it ends (as NP08PeakFind9 kept tracelen/2
+*  around each crossing), and the overlapping ranges are merged, so the
+*  capture becomes a few intervals of variable length.  The samples of all
+*  the enabled channels are written for every interval.
+*  The file is binary, little-endian.  It starts with (all int32 after the
+*  magic)
+*    "NP08ZS1\0", runNumber, nSamples, nPreSamples, timeIntervalNs,
+*    zsPre, zsPost, maxADCValue, range index of A B C D (-1 if disabled)
+*  then one block per capture
+*    uint32 bytes in the block after this word
+*    uint32 group, uint32 capture
+*    uint8 bytes per sample (1 when the captures are packed, see
+*      NP08PackCaptures(), the top byte of the ADC value, otherwise 2)
+*    uint8 channel mask (bit 0 = A), uint16 number of intervals
+*    uint16 first tick, uint16 length of each interval
+*    the samples: for each interval, for each channel in the mask, the
+*      length samples
+*  There are at most NP08_ZS_MAX intervals, the last one is stretched over
+*  any further ones.
+****************************************************************************/
+#define NP08_ZS_MAX 256        // Most intervals in a capture
+
+void NP08WriteZS(UNIT * unit, NP08VARS * np08, uint32_t capture)
+{
+  uint8_t head[24 + 4 * NP08_ZS_MAX];
+  uint16_t zs[NP08_ZS_MAX][2];
+  int32_t hdr[11], t, in, was = 0, nz = 0, nchan = 0, sb = 1, j, k, n;
+  uint32_t u;
+  uint16_t w;
+  uint8_t mask = 0;
+
+  for (j = 0; j < unit->channelCount && j < 4; j++) {
+    if (!unit->channelSettings[j].enabled) continue;
+    mask |= 1 << j;
+    nchan++;
+    if (!(np08->packMask & (1 << j))) sb = 2;
+  }
+  if (np08->zsFileSize == 0) {    // The file header, with the first block as the time interval is known by then
+    hdr[0] = np08->runNumber;
+    hdr[1] = np08->nSamples;
+    hdr[2] = np08->nPreSamples;
+    hdr[3] = np08->timeIntervalNs;
+    hdr[4] = np08->zsPre;
+    hdr[5] = np08->zsPost;
+    hdr[6] = unit->maxADCValue;
+    for (j = 0; j < 4; j++) hdr[7 + j] = (j < unit->channelCount && unit->channelSettings[j].enabled) ? unit->channelSettings[j].range : -1;
+    np08->zsFileSize += NP08WriterPut(&np08->zsWriter, np08->zsFile, "NP08ZS1", 8);
+    np08->zsFileSize += NP08WriterPut(&np08->zsWriter, np08->zsFile, hdr, sizeof(hdr));
+  }
+
+  // The runs of ones in the mask are the intervals
+  for (t = 0; t <= np08->nSamples; t++) {
+    in = (t < np08->nSamples) ? (int32_t)(np08->zsMask[t >> 6] >> (t & 63)) & 1 : 0;
+    if (in && !was) {
+      if (nz == NP08_ZS_MAX) nz--;    // No room, carry on the last one
+      else zs[nz][0] = t;
+    }
+    if (!in && was) {
+      zs[nz][1] = t - zs[nz][0];
+      nz++;
+    }
+    was = in;
+  }
+
+  n = 0;
+  for (k = 0; k < nz; k++) n += zs[k][1];
+  u = 12 + 4 * nz + n * nchan * sb;
+  memcpy(head, &u, 4);
+  memcpy(head + 4, &np08->currentLoopGroup, 4);
+  memcpy(head + 8, &capture, 4);
+  head[12] = sb;
+  head[13] = mask;
+  w = nz;
+  memcpy(head + 14, &w, 2);
+  memcpy(head + 16, zs, 4 * nz);
+  np08->zsFileSize += NP08WriterPut(&np08->zsWriter, np08->zsFile, head, 16 + 4 * nz);
+  for (k = 0; k < nz; k++) {
+    for (j = 0; j < 4; j++) {
+      if (!(mask & (1 << j))) continue;
+      if (sb == 1) np08->zsFileSize += NP08WriterPut(&np08->zsWriter, np08->zsFile, np08->packBuffers[j][capture] + zs[k][0], zs[k][1]);
+      else np08->zsFileSize += NP08WriterPut(&np08->zsWriter, np08->zsFile, np08->rapidBuffers[j][capture] + zs[k][0], 2 * zs[k][1]);
+    }
+  }
+}
+
+// The data record for NP08PeakFinder5 is:      ABCD for 4 channel scope, AB for 2channel scope
+// #g,#c,allok,[A1,B1,C1,D1]*(flag-if-peak-found,interpolated-time,peak-height       )
+//      if np08->cfdOnOff is set, bracket also contains (    ,time-bin-of-peak,cfd-front,cfd-back,end-time)
+// If np08->secondChan is not -1, i.e. second peak enabled => a fifth peak record is added for this
+// If waveOnOff is on, it writes 15 channels of waveform for each of the 2,4 or 5 peaks  
+// If np08->stitchWindow is set, extra slot 0 may hold a decay found in a later capture (ex_ok = 3, see NP08StitchOffer)
+// If np08->pileDip is set, extra slot 0 may hold a decay piled up on the main pulse (ex_ok = 4, see NP08SplitPileup)
+// If np08->fitLearn is set, 4x(fit flag), 4x(fitted amplitude), 4x(fitted time), 4x(chi2 per dof) of the main pulses follow
+//   the extra pulses (all zero until the template of the channel is learnt, see NP08FitPulse)
+// If np08->chargeTotal is set, 4x(prompt charge), 4x(total charge), 4x(prompt/total) of the main pulses and the same of
+//   the extra pulses follow (zero where there is no pulse or the windows go out of the capture, see NP08Charge)
+// If np08->baseMode is set, 4x(pedestal), 4x(noise RMS) follow, and with baseMode 2 the heights and bases in the record
+//   are relative to the pedestal (see NP08TrackBaseline)
+// If np08->pileDip is set, the main pulse on the second channel split in two follows, whether or not slot 0 took the
+//   second one: (flag,interpolated-time,height) of the first and (interpolated-time,height) of the second
+// If np08->exKeep is more than NP08_EX_SLOTS, the number of extra pulses after slot 0 follows, then for each slot from
+//   NP08_EX_SLOTS to exKeep (flag,index,interpolated-time,height,base,end-time), and with charges (prompt,total)
+
+// Copies extra pulse slot from to slot to
+static __forceinline void NP08ExCopy(NP08EVENT * ev, int to, int from)
+{
+  ev->ex_ok[to] = ev->ex_ok[from];
+  ev->ex_index[to] = ev->ex_index[from];
+  ev->ex_height[to] = ev->ex_height[from];
+  ev->ex_interp[to] = ev->ex_interp[from];
+  ev->ex_base[to] = ev->ex_base[from];
+  ev->ex_endindex[to] = ev->ex_endindex[from];
+  ev->ex_hb[to] = ev->ex_hb[from];
+  ev->ex_qPrompt[to] = ev->ex_qPrompt[from];
+  ev->ex_qTotal[to] = ev->ex_qTotal[from];
+}
+
+void NP08PeakFind5(UNIT* unit, NP08VARS* np08, FILE* file)
+{
+  uint32_t capture;
+  int16_t channel;
+  int32_t j, k;
+  int okall;
+  int hb1, j1;
+  NP08EVENT ev;        // The A1 B1 C1 D1 pulses and the B3,B4,B5,B6 ones (the ex_ variables, for 'extra')
+  NP08FINDKERNEL findPulses;
+  NP08TEMPLATE * tp;
+  int32_t prefix[NP08_MAX_SAMPLES + 1];   // Prefix sums of one channel for the charges
+  uint64_t tick = 0;   // Only read from the trigger information with stitching
+  
+  // Parameters:
+  //     np08->secondChan         Channel number to hunt for second peak
+  //     np08->secondMinDelay     Minimum delay from first peak to consider (was fixed at 50 ticks)
+  //     np08->writePeakCount     (exists, but currently ignored.  Value 0->3 = require peak on this channel to be above np08->writePeakHeight
+  //                                 Value 11->14 = require the number of channels with peaks to be bigger than this)
+  //     np08->writePeakHeight    Used as threshold on peak to write out (only works if higher than the time threshold, so may be useless)
+  //     np08->cfdOnOff           Enables writing CFD values
+  //     np08->waveOnOff          Enables writing wave samples
+
+  if (!np08->isMemAllocated) { printf("No data collected\n"); return; }
+  if (np08->statusBulk != PICO_OK || np08->statusTrig != PICO_OK) {
+    printf("Error when collecting data, not analysing it.  Codes are %d %d\n", np08->statusBulk, np08->statusTrig);
+    return;
+  }
+
+  findPulses = NP08PickKernel(unit);   // Compiled for this channel setup, see NP08FindBody()
+  if (!NP08CoincCompile(np08, unit->channelCount)) np08->coincCount = 0;
+  if (!NP08CutCompile(np08)) np08->cutCount = 0;
+  if (np08->upsample > 0) NP08UpTable(np08->upTable, np08->upsample);
+  if (np08->pileDip > 0) NP08PileShape(np08->pileShape, np08->pileRise);
+
+  int32_t countCut2 = 0;
+  for (capture = 0; capture < np08->nCapturesM; capture++) {
+
+    if (np08->baseMode > 0) {    // Before finding the pulses, with baseMode 2 the thresholds follow the pedestal
+      NP08TrackBaseline(unit, np08, capture);
+      for (j = 0; j < 4; j++) {
+	ev.ped[j] = (float)np08->basePed[j];
+	ev.rms[j] = (float)np08->baseRms[j];
+      }
+    }
+    if (np08->batchMode && np08->baseMode != 2 && capture % NP08_BATCH == 0) NP08BatchExtract(unit, np08, capture);
+    findPulses(unit, np08, capture, &ev);
+
+    // Crossing times from the upsampled signal, for the main pulses and the extra ones (before the preferred one is picked)
+    if (np08->upsample > 0) {
+      for (j = 0; j < unit->channelCount && j < 4; j++) {
+	if (ev.ok[j]) ev.interp[j] = NP08UpsampleCross(np08->upTable, np08->rapidBuffers[j][capture], np08->nSamples, ev.index[j], NP08Threshold(np08, j), ev.interp[j]);
+      }
+      if (np08->secondChan >= 0 && np08->secondChan < unit->channelCount && np08->secondChan < 4) {
+	for (k = 1; k <= ev.nex; k++) {
+	  if (ev.ex_ok[k] == 1) {
+	    ev.ex_interp[k] = NP08UpsampleCross(np08->upTable, np08->rapidBuffers[np08->secondChan][capture], np08->nSamples, ev.ex_index[k],
+						NP08Threshold(np08, np08->secondChan), ev.ex_interp[k]);
+	  }
+	}
+      }
+    }
+    
+    // This little section helps the analysis clode by finding the preferred pulse from among B3,B4,B5,B6 (slots 1..nex of the ex_* variables here)
+    // and moving it to slot 0, the others stay in order behind it.  It allows a decent analysis to hopefully be done by using B3 and ignoring the others.
+    
+    hb1 = 0;     // These are the ones that should work.  Biggest peak - base when skipping to tick 300
+    j1 = -3;	
+    for (j = 1; j <= ev.nex; j++) {   // Loop over the extra pulses found
+		if (ev.ex_index[j] == 0) continue;
+		if (ev.ex_index[j] - ev.index[0] < np08->secondMinDelay) continue;      // (timeThisPulse - timeB1) < 50 Attempt to chop out the big pulse after an early pulse
+		if (ev.ex_hb[j] > hb1) {             // ex_hb More positive = bigger pulse
+			hb1 = ev.ex_hb[j];
+			j1 = j;
+		}
+    }
+
+    if (j1 != -3) {    // Move the preferred one to position 0 (empty if none was found) and close up the others
+      NP08ExCopy(&ev, 0, j1);
+      for (j = j1; j < ev.nex; j++) NP08ExCopy(&ev, j, j + 1);
+      NP08ExClear(&ev, ev.nex);
+      ev.nex--;
+    }
+
+    // TODO   Insert the CFD for the extra pulse here
+
+    // A decay piled up on the main pulse goes in the place of the preferred pulse if there isn't one
+    if (ev.pileOk) ev.pileFirst.interp = ev.interp[np08->secondChan];   // After any upsampling
+    if (ev.pileOk && ev.ex_ok[0] == 0) {
+      ev.ex_ok[0] = 4; ev.ex_index[0] = ev.pile.index; ev.ex_height[0] = ev.pile.height; ev.ex_interp[0] = ev.pile.interp;
+      ev.ex_base[0] = ev.pile.base; ev.ex_endindex[0] = ev.pile.end; ev.ex_hb[0] = -(ev.pile.height - ev.pile.base);
+    }
+
+    // Offer the main pulse on the second channel to the records held back from earlier captures, it may be their decay
+    if (np08->stitchWindow > 0) {
+      tick = np08->triggerInfo[capture].timeStampCounter & NP08_TIMESTAMP_MASK;
+      if ((np08->triggerInfo[capture].status & PICO_DEVICE_TIME_STAMP_RESET) || (int64_t)tick < np08->triggerTimeLast) {
+	NP08StitchRelease(unit, np08, file, tick, 1);   // Time stamps restarted, can't relate the held ones to this capture
+      }
+      if (np08->secondChan >= 0 && np08->secondChan < unit->channelCount && ev.ok[np08->secondChan]) {
+	NP08StitchOffer(np08, capture, tick, ev.index[np08->secondChan], ev.interp[np08->secondChan], ev.height[np08->secondChan]);
+      }
+      NP08StitchRelease(unit, np08, file, tick, 0);
+      np08->triggerTimeLast = (int64_t)tick;
+    }
+
+    // Decide whether to write this one out
+    okall = 0;                               // It is bad trigger unless it passes all the following
+    if (np08->coincCount > 0) {
+      okall = NP08CoincEval(np08, np08->nSamples);
+    } else if (np08->writePeakCount >=0 && np08->writePeakCount < unit->channelCount) {
+      if (ev.ok[np08->writePeakCount]) okall = 1;
+    } else if (np08->writePeakCount >=10 && np08->writePeakCount < 14) {
+      if (ev.ok[0]+ev.ok[1]+ev.ok[2]+ev.ok[3] >= np08->writePeakCount-10) okall = 1;
+    }
+    
+    if (okall) {
+
+      //TODO We can implemnt the SW threshold trigger on one channel (writeCoun = 1->4) right at the start - zip through the samples of the selected channel anc hint for one big enough, then skip all the processing in the event if not satisfied.
+
+      ev.group = np08->currentLoopGroup;
+      ev.capture = capture;
+      ev.okall = okall;
+      ev.tick = (np08->stitchWindow > 0) ? tick : 0;
+      if (np08->waveOnOff) {
+	for (j = 0; j < unit->channelCount; j++) {    // Copy the waveforms around the four signals
+	  channel = j;    // Look on channel B,A,C,B for the four searches.
+	  for (k = ev.index[j] - 7; k < ev.index[j] + 7; k++) {// Include exactly 15 channels in waveform
+	    if (k < 0 || k >= np08->nSamples) ev.wave[j][k - ev.index[j] + 7] = 0;
+	    else ev.wave[j][k - ev.index[j] + 7] = np08->rapidBuffers[channel][capture][k];
+	  }
+	}
+      }
+
+      // Template fit of the main pulses, once the first np08->fitLearn of them have been made into the template
+      if (np08->fitLearn > 0) {
+	for (j = 0; j < unit->channelCount && j < 4; j++) {
+	  if (!ev.ok[j]) continue;
+	  tp = &np08->fitTemplate[j];
+	  if (tp->ready) {
+	    ev.fitOk[j] = NP08FitPulse(tp, np08->rapidBuffers[j][capture], np08->nSamples, ev.index[j], ev.base[j], ev.height[j],
+				       &ev.fitAmp[j], &ev.fitTime[j], &ev.fitChi2[j]);
+	  } else {
+	    NP08TemplateAdd(tp, np08->rapidBuffers[j][capture], np08->nSamples, ev.index[j], ev.base[j], ev.height[j]);
+	    if (tp->nLearnt >= np08->fitLearn) NP08TemplateMake(tp);
+	  }
+	}
+      }
+
+      // Charges, from one pass of prefix sums over each channel with a pulse
+      if (np08->chargeTotal > 0) {
+	for (j = 0; j < unit->channelCount && j < 4; j++) {
+	  if (!ev.ok[j] && (j != np08->secondChan || (ev.ex_ok[0] == 0 && ev.nex == 0))) continue;
+	  NP08PrefixSum(np08->rapidBuffers[j][capture], np08->nSamples, prefix);
+	  if (ev.ok[j]) NP08Charge(np08, prefix, np08->nSamples, ev.index[j], &ev.qPrompt[j], &ev.qTotal[j]);
+	  if (j != np08->secondChan) continue;
+	  for (k = 0; k <= ev.nex; k++) {
+	    if (ev.ex_ok[k] == 1 || ev.ex_ok[k] == 4) {   // Not the stitched ones (ex_ok = 3), they are in another capture
+	      NP08Charge(np08, prefix, np08->nSamples, ev.ex_index[k], &ev.ex_qPrompt[k], &ev.ex_qTotal[k]);
+	    }
+	  }
+	}
+      }
+
+      // The pulse shapes of the main pulses and the preferred extra one (not a stitched one, it is in another capture)
+      if (np08->avgGroups > 0) {
+	for (j = 0; j < unit->channelCount && j < 4; j++) {
+	  if (ev.ok[j]) NP08AverageAdd(&np08->avg[0][j], np08->rapidBuffers[j][capture], np08->nSamples, ev.interp[j]);
+	}
+	if (np08->secondChan >= 0 && np08->secondChan < unit->channelCount && np08->secondChan < 4 && (ev.ex_ok[0] == 1 || ev.ex_ok[0] == 4)) {
+	  NP08AverageAdd(&np08->avg[1][np08->secondChan], np08->rapidBuffers[np08->secondChan][capture], np08->nSamples, ev.ex_interp[0]);
+	}
+      }
+      if (np08->zsFile != NULL) NP08WriteZS(unit, np08, capture);   // Before the record cut, which is only applied to the record
+	  countCut2++;
+      if (np08->stitchWindow > 0) NP08StitchAdd(unit, np08, file, &ev);   // Held back in case a later capture has its decay
+      else NP08WriteEvent(unit, np08, file, &ev);
+    }
+  }  // End loop over captures
+  np08->batchFirst = -1;    // The lists were for this pass only
+  np08->countCut2 = countCut2;
+}
+
+#if 0
+void NP08PeakFind9(UNIT * unit, NP08VARS * np08)
+{
+  uint32_t capture;
+  int16_t channel;
+  int32_t i,j,tracelen;
+  char yes[100000];
+  
+  // Warn if the yes array is not big enough
+  if (np08->nSamples > 100000) {
+	  printf("Fixed length array is dimensioned at 100000 which is smaller than the number of samples, sorry\n");
+	  return;
+  }
+
+  // May modify these to be arguments to the function call, so we can automate web page write
+  printf("Select capture to find peaks:\n");
   fflush(stdin);
   scanf_s("%lud", &capture);
   printf("Capture %d. Select window size in trace:\n",capture);
@@ -3630,7 +6817,183 @@ void NP08PeakFind9(UNIT * unit, NP08VARS * np08)
     }
   }
 }
-#endif
+#endif
+
+/****************************************************************************
+* Shaping filters
+*  Applied in place to the captures of the channels that have
+*  np08->filterType[] set, straight after they are collected, so the peak
+*  finding, the output heights and the waveforms all see the filtered signal.
+*    1 moving average of np08->filterLength[] ticks (causal, so pulses are
+*      delayed by about half the length)
+*    2 trapezoidal shaper (Jordanov) with rise np08->filterLength[] = k and
+*      flat top np08->filterFlat[] = m.  With np08->filterPoleZero[] = M > 0
+*      the pole-zero correction for an exponential tail of M ticks is added.
+*      The shaper removes the baseline, so the mean of the first 16 samples
+*      is added back, and it is scaled by 1/k (1/kM with the correction) to
+*      keep pulse heights close to the raw ones, so thresholds stay usable.
+*  Both are a running sum (two for the pole-zero) of differences of delayed
+*  samples.  With SSE2 the sums are done four samples at a time with a
+*  shift-and-add scan, and the scalar code does the rest of the samples with
+*  the same arithmetic, so the results don't depend on which path did them.
+*  Samples before the start of the capture are taken to be equal to the
+*  first one (the trapezoid uses the baseline mean).
+****************************************************************************/
+#define NP08_FILTER_PAD 128    // Room to look back before the first sample, more than 2k+m and the longest moving average
+
+#ifdef NP08_SSE2
+// Running sum of the four lanes of v, continuing from *carry (the previous total in all four lanes)
+static __forceinline __m128i NP08Scan4(__m128i v, __m128i * carry)
+{
+  v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+  v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+  v = _mm_add_epi32(v, *carry);
+  *carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+  return v;
+}
+#endif
+
+// Moving average over L ticks of the n samples in x
+void NP08FilterMovingAverage(int16_t * x, int32_t n, int32_t L)
+{
+  int16_t buf[NP08_FILTER_PAD + NP08_MAX_SAMPLES];
+  int16_t * t = buf + NP08_FILTER_PAD;
+  int32_t i, acc, v;
+  float inv = 1.0f / L;
+
+  for (i = -NP08_FILTER_PAD; i < 0; i++) t[i] = x[0];
+  memcpy(t, x, n * sizeof(int16_t));
+  acc = L * x[0];   // Sum of the L samples before the first one
+  i = 0;
+#ifdef NP08_SSE2
+  {
+    __m128i carry = _mm_set1_epi32(acc), e;
+    __m128 vinv = _mm_set1_ps(inv);
+    for (; i + 4 <= n; i += 4) {
+      e = _mm_sub_epi32(NP08_LOAD4(t + i), NP08_LOAD4(t + i - L));
+      e = NP08Scan4(e, &carry);
+      e = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(e), vinv));
+      _mm_storel_epi64((__m128i*)(x + i), _mm_packs_epi32(e, e));
+    }
+    acc = _mm_cvtsi128_si32(carry);
+  }
+#endif
+  for (; i < n; i++) {
+    acc += t[i] - t[i - L];
+    v = (int32_t)lrintf((float)acc * inv);
+    x[i] = (int16_t)v;   // An average can't go out of range
+  }
+}
+
+// Trapezoidal shaper with rise k, flat top m and pole-zero correction M (0 = none) of the n samples in x
+void NP08FilterTrapezoid(int16_t * x, int32_t n, int32_t k, int32_t m, int32_t M)
+{
+  int16_t buf[NP08_FILTER_PAD + NP08_MAX_SAMPLES];
+  int16_t * t = buf + NP08_FILTER_PAD;
+  int32_t i, l = k + m, d, p = 0, q = 0, v, base = 0, nb;
+  float invK = 1.0f / k;
+  float invKM = (M > 0) ? 1.0f / ((float)k * M) : 0.0f;
+
+  nb = (n < 16) ? n : 16;
+  for (i = 0; i < nb; i++) base += x[i];
+  base = (base + nb / 2) / nb;
+  for (i = -NP08_FILTER_PAD; i < 0; i++) t[i] = (int16_t)base;
+  memcpy(t, x, n * sizeof(int16_t));
+  i = 0;
+#ifdef NP08_SSE2
+  {
+    __m128i pc = _mm_setzero_si128(), qc = _mm_setzero_si128(), vbase = _mm_set1_epi32(base), e, pv, qv;
+    __m128 vk = _mm_set1_ps(invK), vkm = _mm_set1_ps(invKM);
+    for (; i + 4 <= n; i += 4) {
+      e = _mm_add_epi32(_mm_sub_epi32(NP08_LOAD4(t + i), NP08_LOAD4(t + i - k)),
+			_mm_sub_epi32(NP08_LOAD4(t + i - l - k), NP08_LOAD4(t + i - l)));
+      pv = NP08Scan4(e, &pc);
+      qv = NP08Scan4(pv, &qc);
+      e = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(pv), vk), _mm_mul_ps(_mm_cvtepi32_ps(qv), vkm)));
+      e = _mm_add_epi32(e, vbase);
+      _mm_storel_epi64((__m128i*)(x + i), _mm_packs_epi32(e, e));
+    }
+    p = _mm_cvtsi128_si32(pc);
+    q = _mm_cvtsi128_si32(qc);
+  }
+#endif
+  for (; i < n; i++) {
+    d = t[i] - t[i - k] - t[i - l] + t[i - l - k];
+    p += d;         // Difference of two moving sums of k, l apart: the trapezoid for a step
+    q += p;         // Sum of p; q + M*p is the trapezoid for an exponential with time constant M
+    v = (int32_t)lrintf((float)p * invK + (float)q * invKM) + base;
+    x[i] = (int16_t)((v > 32767) ? 32767 : (v < -32768) ? -32768 : v);
+  }
+}
+
+// Filter the collected captures of each channel that has a filter selected
+void NP08FilterCaptures(UNIT * unit, NP08VARS * np08)
+{
+  int16_t channel;
+  uint32_t capture;
+
+  for (channel = 0; channel < unit->channelCount && channel < 4; channel++) {
+    if (!unit->channelSettings[channel].enabled || np08->filterType[channel] == 0) continue;
+    for (capture = 0; capture < np08->nCapturesM; capture++) {
+      if (np08->filterType[channel] == 1) {
+	NP08FilterMovingAverage(np08->rapidBuffers[channel][capture], np08->nSamples, np08->filterLength[channel]);
+      } else {
+	NP08FilterTrapezoid(np08->rapidBuffers[channel][capture], np08->nSamples, np08->filterLength[channel],
+			    np08->filterFlat[channel], np08->filterPoleZero[channel]);
+      }
+    }
+  }
+}
+
+/****************************************************************************
+* NP08PackCaptures
+*  In 8-bit mode the scope gives int16 samples which are all multiples of
+*  256, so the top byte holds all there is.  Once per group, after the
+*  filters, the captures of each unfiltered channel are packed to that byte
+*  in np08->packBuffers, and the pulse search and the baseline tracking read
+*  those instead: half the bytes through the cache for the same answers.
+*  The filters make values between the multiples, so a filtered channel
+*  stays unpacked, as does everything in 12 bit and above.  Bit j of
+*  np08->packMask says channel j was packed.  The packed copies are only
+*  allocated while they are used, so 12 bit and above costs no memory, and
+*  in 8-bit mode the one pass here replaces the int16 reads of the search,
+*  the baseline tracking and the zero-suppressed file.
+****************************************************************************/
+void NP08Pack8(const int16_t * w, int8_t * w8, int32_t n)
+{
+  int32_t i = 0;
+
+#ifdef NP08_SSE2
+  for (; i + 16 <= n; i += 16) {
+    _mm_storeu_si128((__m128i *)(w8 + i), _mm_packs_epi16(_mm_srai_epi16(_mm_loadu_si128((const __m128i *)(w + i)), 8),
+							   _mm_srai_epi16(_mm_loadu_si128((const __m128i *)(w + i + 8)), 8)));
+  }
+#endif
+  for (; i < n; i++) w8[i] = (int8_t)(w[i] >> 8);
+}
+
+void NP08PackCaptures(UNIT * unit, NP08VARS * np08)
+{
+  int16_t channel;
+  uint32_t capture;
+
+  np08->packMask = 0;
+  if (!np08->packMode || unit->resolution != PS5000A_DR_8BIT) {
+    NP08PackFree(unit, np08);   // Not needed (any more)
+    return;
+  }
+  if (!NP08PackAllocate(unit, np08)) {
+    printf("Not enough memory to pack the captures, using the int16 samples\n");
+    return;
+  }
+  for (channel = 0; channel < unit->channelCount && channel < 4; channel++) {
+    if (!unit->channelSettings[channel].enabled || np08->filterType[channel] != 0) continue;
+    for (capture = 0; capture < np08->nCapturesM; capture++) {
+      NP08Pack8(np08->rapidBuffers[channel][capture], np08->packBuffers[channel][capture], np08->nSamples);
+    }
+    np08->packMask |= 1 << channel;
+  }
+}
 
 /****************************************************************************
 * NP08CollectRapidBlock
@@ -3824,12 +7187,21 @@ int NP08CollectRapidBlock(UNIT * unit, NP08VARS * np08, int init, int prnt)
       status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE) {
     printf("\nPower Source Changed. Data collection aborted.\n");
   }
+  if (np08->statusBulk == PICO_OK) {
+    NP08FilterCaptures(unit, np08);
+    NP08PackCaptures(unit, np08);
+  } else {
+    np08->packMask = 0;
+  }
 
-  // Retrieve trigger timestamping information
-  //memset(np08->triggerInfo, 0, np08->nCapturesM * sizeof(PS5000A_TRIGGER_INFO));
-  //status = ps5000aGetTriggerInfoBulk(unit->handle, np08->triggerInfo, 0, np08->nCapturesM - 1);
-  //np08->statusTrig = status;
-  np08->statusTrig = 0;   // Comment this line if you uncomment the above to get the trigger info
+  // Retrieve trigger timestamping information, only needed for the cross-capture stitching in NP08PeakFind5()
+  memset(np08->triggerInfo, 0, np08->nCapturesM * sizeof(PS5000A_TRIGGER_INFO));
+  if (np08->stitchWindow > 0) {
+    status = ps5000aGetTriggerInfoBulk(unit->handle, np08->triggerInfo, 0, np08->nCapturesM - 1);
+    np08->statusTrig = status;
+  } else {
+    np08->statusTrig = 0;
+  }
   
   // Stop
   status = ps5000aStop(unit->handle);
@@ -3859,6 +7231,38 @@ void printTriggerTimeInfo(NP08VARS * np08, int level) {    // Print info from ps
 	np08->triggerTimeLast = np08->triggerInfo[k].triggerTime;
 }
 
+/****************************************************************************
+* NP08IndexGroup
+*  With np08->idxMode set, NP08Loop() writes runD_XXXXXX.idx next to the
+*  run file, so a tool can go straight to a group of a long run, split the
+*  file between readers, or follow a run that is still being taken.  It is
+*  binary, little-endian: "NP08IDX1", uint32 runNumber, uint32 size of an
+*  entry (32), then one NP08INDEXENTRY for each group, in order, so the
+*  entry of group g is at 16 + 32 g.  An entry gives the part of the run
+*  file and the byte at which the records written during the group start;
+*  they end where the next entry starts (or at the end of the part).  Each
+*  entry is flushed as its group is done.  With stitching, a record can be
+*  written during a later group than its own (see NP08StitchRelease), and
+*  the records still held at the end of the run come after the last entry.
+*  The trigger time stamps are only read from the scope for the stitching,
+*  so without it the tick of the entries is all ones.
+****************************************************************************/
+
+// Add the entry of group, whose records are from offset in part of the run file
+void NP08IndexGroup(NP08VARS * np08, uint32_t group, int32_t part, uint64_t offset, uint32_t records)
+{
+  NP08INDEXENTRY e;
+
+  e.group = group;
+  e.part = part;
+  e.offset = offset;
+  e.records = records;
+  e.captures = np08->nCapturesM;
+  e.tick = (np08->stitchWindow > 0 && np08->statusTrig == PICO_OK) ? np08->triggerInfo[0].timeStampCounter & NP08_TIMESTAMP_MASK : ~0ULL;
+  fwrite(&e, sizeof(e), 1, np08->idxFile);
+  fflush(np08->idxFile);
+}
+
 // Loop over calls to NP08CollectRapidMode() and NP08PeakFind2()
 void NP08Loop(UNIT * unit, NP08VARS * np08)
 {
@@ -3866,9 +7270,17 @@ void NP08Loop(UNIT * unit, NP08VARS * np08)
 	int igroup;
 	int st = 0;
 	int cntr = 2;
-	char filename[1000], logname[1000], ratename[1000];
+	char filename[1000], logname[1000], ratename[1000], avgname[1000], partname[1000];
 	FILE* file;
+	FILE* newfile;
+	FILE* logfile;
+	int part = 0;          // Part of the run file being written, 0 = runD_XXXXXX.dat, then runD_XXXXXX_partNNN.dat
+	int partFirst = 0;     // First group in it
 	FILE* ratefile;
+	FILE* avgfile = NULL;
+	char zsname[1000], colname[1000], arrowname[1000], idxname[1000];
+	uint64_t groupOffset, groupRecords;   // Where the records of the group start in the run file, and the records before it
+	uint32_t idxHead[2];
 	int64_t StartTime_micros;
 	int64_t EndTime_micros;
 	double DiffTime_micros;
@@ -3902,6 +7314,10 @@ void NP08Loop(UNIT * unit, NP08VARS * np08)
 	} while (np08->runNumber > 999999);
 
 	np08->currentFileSize = 0;
+	np08->runFileSize = 0;
+	np08->recordCount = 0;
+	np08->stitchCount = 0;
+	np08->triggerTimeLast = 0;
 	do {
 		snprintf(filename, 1000, "runD_%6.6d.dat", np08->runNumber);
 		snprintf(logname, 1000, "runD_%6.6d.log", np08->runNumber);
@@ -3913,13 +7329,65 @@ void NP08Loop(UNIT * unit, NP08VARS * np08)
 		fprintf(file, "\n");
 		displaySettings(unit, file);
 		fprintf(file, "RunStartTime = %s.%09ld", RunStartTime);
+		fprintf(file, "\nParts of the run file (a new one every %d MB):", np08->maxFileSize);    // Then one line as each is finished
 		fclose(file);
 
 		printf("Run number is %d, data will be written to %s.  Settings are written to %s.  Data collection starting, processing with PeakFind5.\n",
 			np08->runNumber, filename, logname);
 
 		fopen_s(&file, filename, "w");
+		NP08WriterStart(np08, &np08->writer, file);
 		fopen_s(&ratefile, ratename, "w");
+		if (np08->avgGroups > 0) {
+			snprintf(avgname, 1000, "runD_%6.6d_avg.dat", np08->runNumber);
+			fopen_s(&avgfile, avgname, "w");
+			memset(np08->avg, 0, sizeof(np08->avg));
+			printf("Averaged pulse shapes are written to %s every %d groups.\n", avgname, np08->avgGroups);
+		}
+		np08->idxFile = NULL;
+		if (np08->idxMode) {
+			snprintf(idxname, 1000, "runD_%6.6d.idx", np08->runNumber);
+			if (fopen_s(&np08->idxFile, idxname, "wb") != 0) np08->idxFile = NULL;
+			if (np08->idxFile == NULL) {
+				printf("Could not open %s, no index of the run file\n", idxname);
+			} else {
+				idxHead[0] = np08->runNumber;
+				idxHead[1] = sizeof(NP08INDEXENTRY);
+				fwrite("NP08IDX1", 1, 8, np08->idxFile);
+				fwrite(idxHead, sizeof(idxHead), 1, np08->idxFile);
+				printf("The index of the groups in the run file is written to %s.\n", idxname);
+			}
+		}
+		np08->zsFile = NULL;
+		np08->zsFileSize = 0;
+		if (np08->zsMode) {
+			snprintf(zsname, 1000, "runD_%6.6d_zs.dat", np08->runNumber);
+			if (fopen_s(&np08->zsFile, zsname, "wb") != 0) np08->zsFile = NULL;
+			if (np08->zsFile == NULL) printf("Could not open %s, no zero-suppressed waveforms\n", zsname);
+			else printf("Zero-suppressed waveforms are written to %s.\n", zsname);
+			NP08WriterStart(np08, &np08->zsWriter, np08->zsFile);
+		}
+		np08->colFile = NULL;
+		if (np08->colMode) {
+			snprintf(colname, 1000, "runD_%6.6d_col.dat", np08->runNumber);
+			if (fopen_s(&np08->colFile, colname, "wb") != 0) np08->colFile = NULL;
+			if (np08->colFile == NULL) printf("Could not open %s, no columnar copy of the records\n", colname);
+			else printf("The records are also written in columns to %s.\n", colname);
+		}
+		np08->arrowFile = NULL;
+		if (np08->arrowMode) {
+			snprintf(arrowname, 1000, "runD_%6.6d.feather", np08->runNumber);
+			if (fopen_s(&np08->arrowFile, arrowname, "wb") != 0) np08->arrowFile = NULL;
+			if (np08->arrowFile == NULL) printf("Could not open %s, no Arrow copy of the records\n", arrowname);
+			else printf("The records are also written in Arrow format to %s.\n", arrowname);
+		}
+		if ((np08->colFile != NULL || np08->arrowFile != NULL) && !NP08ColumnsStart(unit, np08)) {
+			printf("Not enough memory for the columnar copies of the records\n");
+			if (np08->colFile != NULL) fclose(np08->colFile);
+			if (np08->arrowFile != NULL) fclose(np08->arrowFile);
+			np08->colFile = NULL;
+			np08->arrowFile = NULL;
+		}
 
 		timespec_get(&now, TIME_UTC);
 		char CurrTime[100];
@@ -3938,7 +7406,16 @@ void NP08Loop(UNIT * unit, NP08VARS * np08)
 			st = NP08CollectRapidBlock(unit, np08, (igroup == 0) ? 1 : 0, 0);
 			// printTriggerTimeInfo(np08, 1);  // To use this, also uncomment the GetTriggerInfoBulk() call in NP08CollectRapidBlock()
 			// NP08PeakFind2(unit, np08, file);
+			groupOffset = np08->currentFileSize;
+			groupRecords = np08->recordCount;
 			NP08PeakFind5(unit, np08, file);
+			if (np08->idxFile != NULL) NP08IndexGroup(np08, igroup, part, groupOffset, (uint32_t)(np08->recordCount - groupRecords));
+			NP08ColumnsFlush(np08);    // The records of the group make a chunk
+			if (avgfile && (igroup + 1) % np08->avgGroups == 0) NP08AverageFlush(unit, np08, avgfile, igroup);
+			if (np08->writeFlush) NP08WriterFlush(&np08->writer);
+			if (np08->writeFlush) NP08WriterFlush(&np08->zsWriter);
+			if (np08->writeFlush) NP08WriterFlush(&np08->colWriter);
+			if (np08->writeFlush) NP08WriterFlush(&np08->arrowWriter);
 
 			EndTime_micros = GetTime_MicroSecond();
 			
@@ -3965,22 +7442,77 @@ void NP08Loop(UNIT * unit, NP08VARS * np08)
 
 			fprintf(ratefile,"%s.%09ld,%g,%g,%g,%g\n", CurrTime, now.tv_nsec, Rate_Cut1, Rate_Cut2, Rate_Cut1_Avg, Rate_Cut2_Avg); //Print rates to file
 
-			printf("Done loop %d of %d | File size is %dkB of max %dMB | CUT1 rate (Hz) %g | CUT2 rate (Hz) %g | CUT1 Avg rate (Hz) %g | CUT2 Avg rate (Hz) %g\n", igroup, ngroup, np08->currentFileSize / 1024, np08->maxFileSize, Rate_Cut1, Rate_Cut2, Rate_Cut1_Avg, Rate_Cut2_Avg);
+			printf("Done loop %d of %d | File part %d is %lldkB of %dMB | CUT1 rate (Hz) %g | CUT2 rate (Hz) %g | CUT1 Avg rate (Hz) %g | CUT2 Avg rate (Hz) %g\n", igroup, ngroup, part, (long long)(np08->currentFileSize / 1024), np08->maxFileSize, Rate_Cut1, Rate_Cut2, Rate_Cut1_Avg, Rate_Cut2_Avg);
 			if (st == 1) {
 				printf("Requested stop\n");
 				break;
 			}
-			if (np08->currentFileSize / 1024 / 1024 > np08->maxFileSize) {
+			if (NP08WriterFailed(&np08->writer, file) || (np08->zsFile != NULL && NP08WriterFailed(&np08->zsWriter, np08->zsFile)) ||
+			    (np08->colFile != NULL && NP08WriterFailed(&np08->colWriter, np08->colFile)) ||
+			    (np08->arrowFile != NULL && NP08WriterFailed(&np08->arrowWriter, np08->arrowFile))) {
 				st = 2;
-				printf("Stop because max file size reached\n");
+				printf("Stop because the output could not be written, the disk may be full\n");
 				break;
 			}
+			if (igroup + 1 < ngroup && np08->currentFileSize >= (uint64_t)np08->maxFileSize << 20) {    // Carry on in a new part, between two groups
+				snprintf(partname, 1000, "runD_%6.6d_part%03d.dat", np08->runNumber, part + 1);
+				if (fopen_s(&newfile, partname, "w") != 0) {
+					st = 2;
+					printf("Stop because %s could not be opened\n", partname);
+					break;
+				}
+				NP08WriterRotate(&np08->writer, file, newfile);
+				if (fopen_s(&logfile, logname, "a") == 0) {
+					fprintf(logfile, "\n%s groups %d to %d, %lld bytes", filename, partFirst, igroup, (long long)np08->currentFileSize);
+					fclose(logfile);
+				}
+				printf("%s is complete, carrying on in %s\n", filename, partname);
+				file = newfile;
+				strcpy(filename, partname);
+				part++;
+				partFirst = igroup + 1;
+				np08->runFileSize += np08->currentFileSize;
+				np08->currentFileSize = 0;
+			}
 			st = 0;
-		}    // Exits this loop with st=0 (ngroup limit reached) st=1 (requested stop) st=2 (space limit) 
+		}    // Exits this loop with st=0 (ngroup limit reached) st=1 (requested stop) st=2 (output failed)
 
-		printf("%d bytes written to file %s in %d groups\n", np08->currentFileSize, filename, np08->currentLoopGroup);
+		NP08StitchRelease(unit, np08, file, 0, 1);   // Write out anything still held back for a late decay
+		NP08WriterStop(&np08->writer);
+		if (fopen_s(&logfile, logname, "a") == 0) {
+			fprintf(logfile, "\n%s groups %d to %d, %lld bytes", filename, partFirst, np08->currentLoopGroup, (long long)np08->currentFileSize);
+			fclose(logfile);
+		}
+		printf("%lld bytes written to %d file(s) ending with %s in %d groups\n", (long long)(np08->runFileSize + np08->currentFileSize), part + 1,
+		       filename, np08->currentLoopGroup);
 		fclose(file);
 		fclose(ratefile);
+		if (avgfile) {
+			NP08AverageFlush(unit, np08, avgfile, np08->currentLoopGroup);   // What is left of the last block
+			fclose(avgfile);
+			avgfile = NULL;
+		}
+		if (np08->zsFile != NULL) {
+			NP08WriterStop(&np08->zsWriter);
+			printf("%lld bytes of zero-suppressed waveforms written to %s\n", (long long)np08->zsFileSize, zsname);
+			fclose(np08->zsFile);
+			np08->zsFile = NULL;
+		}
+		if (np08->idxFile != NULL) {
+			fclose(np08->idxFile);
+			np08->idxFile = NULL;
+		}
+		NP08ColumnsStop(np08);
+		if (np08->colFile != NULL) {
+			printf("%lld bytes of records in columns written to %s\n", (long long)np08->colFileSize, colname);
+			fclose(np08->colFile);
+			np08->colFile = NULL;
+		}
+		if (np08->arrowFile != NULL) {
+			printf("%lld bytes of records in Arrow format written to %s\n", (long long)np08->arrowFileSize, arrowname);
+			fclose(np08->arrowFile);
+			np08->arrowFile = NULL;
+		}
 
 		if (st != 0) {
 			break;
@@ -3993,6 +7525,613 @@ void NP08Loop(UNIT * unit, NP08VARS * np08)
 	} while (0);  /// Temporary - jump out.   // Loop exit is via a break immediately above here (to allow sequence of runs)
 }
 
+/****************************************************************************
+* NP08StreamMonitor
+*  Long term, low bandwidth record of the detector health.  Streams with the
+*  scope aggregating np08->monitorDownsample samples into one max/min pair, so
+*  the USB traffic and the CPU load are reduced by that factor, and writes one
+*  line per np08->monitorInterval_s seconds to runM_XXXXXX.dat with, for each
+*  channel:
+*    rate of pulses (bins whose minimum goes below np08->peakThreshold[] with the
+*      previous bin above it, so two pulses in the same bin count once)
+*    baseline (mean of the bin mid points (max+min)/2 for bins without a pulse)
+*    noise (rms of those mid points about the baseline)
+*    spread (mean of max-min for bins without a pulse, i.e. the noise inside a bin)
+*  The time is taken from the number of samples received, not the PC clock.
+*  Runs until a key is pressed.
+****************************************************************************/
+// The polling loop, called by NP08StreamMonitor() once streaming has started.  Returns the number of lines written
+int32_t NP08StreamMonitorLoop(UNIT * unit, NP08VARS * np08, FILE * file, BUFFER_INFO * bufferInfo, uint32_t downsampleRatio, uint32_t sampleInterval)
+{
+  PICO_STATUS status;
+  int16_t channel;
+  int16_t mn, mx;
+  uint32_t i;
+  int16_t ** appBuffers = bufferInfo->appBuffers;
+  char CurrTime[100];
+  struct timespec now;
+
+  // Accumulated for the current interval
+  uint64_t nBins = 0;                               // Aggregated bins received (same on every channel)
+  uint32_t nPulses[PS5000A_MAX_CHANNELS];
+  uint64_t nQuiet[PS5000A_MAX_CHANNELS];            // Bins without a pulse, used for baseline and noise
+  int64_t  sumMid[PS5000A_MAX_CHANNELS];            // Sums of 2*mid = max+min, to stay in integers
+  double   sumMid2[PS5000A_MAX_CHANNELS];
+  int64_t  sumSpread[PS5000A_MAX_CHANNELS];
+  int32_t  below[PS5000A_MAX_CHANNELS];             // Last bin was below threshold (kept between polls)
+  int32_t  overflow = 0;
+  double   seconds, base, rms;
+  int32_t  nLines = 0;
+
+  for (channel = 0; channel < PS5000A_MAX_CHANNELS; channel++) {
+    nPulses[channel] = 0; nQuiet[channel] = 0; sumMid[channel] = 0; sumMid2[channel] = 0.; sumSpread[channel] = 0; below[channel] = 0;
+  }
+
+  while (!_kbhit()) {
+    g_ready = FALSE;
+    status = ps5000aGetStreamingLatestValues(unit->handle, callBackStreaming, bufferInfo);
+
+    if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
+	status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE) {
+      printf("\nPower Source Changed. Monitor stopped.\n");
+      return nLines;
+    }
+
+    if (!g_ready || g_sampleCount <= 0) {
+      Sleep(20);   // Nothing new, the scope buffers the data so there is no need to spin
+      continue;
+    }
+    if (g_overflow) overflow = 1;
+
+    for (channel = 0; channel < unit->channelCount; channel++) {
+      if (!unit->channelSettings[channel].enabled) continue;
+      for (i = g_startIndex; i < g_startIndex + (uint32_t)g_sampleCount; i++) {
+	mx = appBuffers[channel * 2][i];
+	mn = appBuffers[channel * 2 + 1][i];
+	if (mn <= np08->peakThreshold[channel]) {     // Pulse in this bin (negative pulses)
+	  if (!below[channel]) nPulses[channel]++;
+	  below[channel] = 1;
+	} else {
+	  below[channel] = 0;
+	  nQuiet[channel]++;
+	  sumMid[channel] += (int32_t)mx + (int32_t)mn;
+	  sumMid2[channel] += ((double)mx + (double)mn) * ((double)mx + (double)mn);
+	  sumSpread[channel] += (int32_t)mx - (int32_t)mn;
+	}
+      }
+    }
+    nBins += g_sampleCount;
+
+    seconds = (double)nBins * downsampleRatio * sampleInterval * 1e-9;
+    if (seconds < np08->monitorInterval_s) continue;
+
+    // Write out this interval and start the next
+    timespec_get(&now, TIME_UTC);
+    strftime(CurrTime, sizeof CurrTime, "%D %T", gmtime(&now.tv_sec));
+    fprintf(file, "%s,%.3f,%d", CurrTime, seconds, overflow);
+    printf("%s", CurrTime);
+    for (channel = 0; channel < unit->channelCount; channel++) {
+      if (!unit->channelSettings[channel].enabled) continue;
+      base = 0.; rms = 0.;
+      if (nQuiet[channel] > 0) {
+	base = 0.5 * (double)sumMid[channel] / (double)nQuiet[channel];
+	rms = 0.25 * sumMid2[channel] / (double)nQuiet[channel] - base * base;
+	rms = (rms > 0.) ? sqrt(rms) : 0.;
+      }
+      fprintf(file, ",%g,%.1f,%.1f,%.1f", nPulses[channel] / seconds, base, rms,
+	      (nQuiet[channel] > 0) ? (double)sumSpread[channel] / (double)nQuiet[channel] : 0.);
+      printf(" | %c rate %g Hz base %.1f noise %.1f", 'A' + channel, nPulses[channel] / seconds, base, rms);
+      nPulses[channel] = 0; nQuiet[channel] = 0; sumMid[channel] = 0; sumMid2[channel] = 0.; sumSpread[channel] = 0;
+    }
+    fprintf(file, "\n");
+    fflush(file);
+    printf("%s\n", overflow ? " | OVERFLOW" : "");
+    nBins = 0;
+    overflow = 0;
+    nLines++;
+  }
+  _getch();
+  return nLines;
+}
+
+void NP08StreamMonitor(UNIT * unit, NP08VARS * np08)
+{
+  int16_t * buffers[2 * PS5000A_MAX_CHANNELS];
+  int16_t * appBuffers[2 * PS5000A_MAX_CHANNELS];
+  uint32_t bufferLength = 200000;   // In aggregated bins.  Must hold more than one poll interval
+  uint32_t sampleInterval = 8;      // ns, as in streamDataHandler
+  uint32_t downsampleRatio = np08->monitorDownsample;
+  uint64_t maxSamples;              // bufferLength bins of raw samples, which passes 32 bits above ratio 21474
+  int16_t channel;
+  int16_t retry;
+  int32_t nLines;
+  PICO_STATUS status;
+  BUFFER_INFO bufferInfo;
+  FILE * file = NULL;
+  char filename[1000];
+
+  if (downsampleRatio < 1) downsampleRatio = 1;
+  maxSamples = (uint64_t)bufferLength * downsampleRatio;   // Only a limit, it doesn't stop without autoStop
+  if (maxSamples > 0xffffffffu) maxSamples = 0xffffffffu;
+
+  do {
+    printf("Run number for the monitor file [0 to 999999]:\n");
+    fflush(stdin);
+    scanf_s("%u", &np08->runNumber);
+  } while (np08->runNumber > 999999);
+  snprintf(filename, 1000, "runM_%6.6d.dat", np08->runNumber);
+
+  setDefaults(unit);
+  status = ps5000aSetSimpleTrigger(unit->handle, 0, PS5000A_CHANNEL_A, 0, PS5000A_RISING, 0, 0);   // Free running
+  for (channel = 0; channel < unit->channelCount; channel++) {
+    buffers[channel * 2] = buffers[channel * 2 + 1] = NULL;
+    appBuffers[channel * 2] = appBuffers[channel * 2 + 1] = NULL;
+    if (unit->channelSettings[channel].enabled) {
+      buffers[channel * 2] = (int16_t*) calloc(bufferLength, sizeof(int16_t));
+      buffers[channel * 2 + 1] = (int16_t*) calloc(bufferLength, sizeof(int16_t));
+      appBuffers[channel * 2] = (int16_t*) calloc(bufferLength, sizeof(int16_t));
+      appBuffers[channel * 2 + 1] = (int16_t*) calloc(bufferLength, sizeof(int16_t));
+      status = ps5000aSetDataBuffers(unit->handle, (PS5000A_CHANNEL)channel, buffers[channel * 2], buffers[channel * 2 + 1],
+				     bufferLength, 0, PS5000A_RATIO_MODE_AGGREGATE);
+      printf(status ? "NP08StreamMonitor:ps5000aSetDataBuffers(channel %d) ------ 0x%08x \n" : "", channel, status);
+    }
+  }
+
+  bufferInfo.unit = unit;
+  bufferInfo.driverBuffers = buffers;
+  bufferInfo.appBuffers = appBuffers;
+
+  do {
+    retry = 0;
+    status = ps5000aRunStreaming(unit->handle, &sampleInterval, PS5000A_NS, 0, (uint32_t)maxSamples, FALSE,
+				 downsampleRatio, PS5000A_RATIO_MODE_AGGREGATE, bufferLength);
+    if (status != PICO_OK) {
+      if (status == PICO_POWER_SUPPLY_CONNECTED || status == PICO_POWER_SUPPLY_NOT_CONNECTED ||
+	  status == PICO_USB3_0_DEVICE_NON_USB3_0_PORT || status == PICO_POWER_SUPPLY_UNDERVOLTAGE) {
+	status = changePowerSource(unit->handle, status, unit);
+	retry = 1;
+      } else {
+	printf("NP08StreamMonitor:ps5000aRunStreaming ------ 0x%08x \n", status);
+      }
+    }
+  } while (retry);
+
+  if (status == PICO_OK) {
+    fopen_s(&file, filename, "w");
+    if (file == NULL) printf("Cannot open the file %s for writing.\n", filename);
+  }
+
+  if (file != NULL) {
+    fprintf(file, "# Health monitor run %d, %d samples of %dns per bin, %d s per line\n",
+	    np08->runNumber, downsampleRatio, sampleInterval, np08->monitorInterval_s);
+    fprintf(file, "time,seconds,overflow");
+    for (channel = 0; channel < unit->channelCount; channel++) {
+      if (unit->channelSettings[channel].enabled) fprintf(file, ",rate%c,base%c,noise%c,spread%c", 'A' + channel, 'A' + channel, 'A' + channel, 'A' + channel);
+    }
+    fprintf(file, "\n");
+    printf("Health monitor writing to %s, one line every %d s.  Press a key to stop\n", filename, np08->monitorInterval_s);
+
+    nLines = NP08StreamMonitorLoop(unit, np08, file, &bufferInfo, downsampleRatio, sampleInterval);
+
+    fclose(file);
+    printf("Health monitor stopped, %d lines written to %s\n", nLines, filename);
+  }
+
+  ps5000aStop(unit->handle);
+
+  for (channel = 0; channel < unit->channelCount; channel++) {
+    if (unit->channelSettings[channel].enabled) {
+      ps5000aSetDataBuffers(unit->handle, (PS5000A_CHANNEL)channel, NULL, NULL, 0, 0, PS5000A_RATIO_MODE_AGGREGATE);
+      free(buffers[channel * 2]);
+      free(buffers[channel * 2 + 1]);
+      free(appBuffers[channel * 2]);
+      free(appBuffers[channel * 2 + 1]);
+    }
+  }
+}
+
+/****************************************************************************
+* NP08Calibrate
+*  Proposes the peak thresholds, and the trigger threshold, from the noise.
+*  It takes np08->calCaptures captures with an auto trigger on a level the
+*  signal never reaches, so they are at random times, and fills a histogram of
+*  the ADC counts of each channel.  The pedestal is its median and the noise
+*  sigma the distance from there up to the 84.13% point, on the side away from
+*  the (negative) pulses, which would widen the other side.  The thresholds
+*  proposed are np08->calSigma sigma below the pedestal, for the signal after
+*  the filters as that is what the peak finding sees.  With baseMode 2 the
+*  peak thresholds are kept as the offset from the pedestal, which
+*  NP08Threshold() adds back on, and only the trigger gets the absolute one.
+****************************************************************************/
+#define NP08_CAL_BINS 65536    // One bin per ADC count, offset by 32768
+
+// Fills the four histograms h[0..3][NP08_CAL_BINS] with the n samples of w, using them in turn so consecutive samples
+// with the same value (most of them, in the noise) don't wait for each other's increment
+void NP08HistFill(uint32_t * h, const int16_t * w, int32_t n)
+{
+  int32_t i = 0;
+#ifdef NP08_SSE2
+  const __m128i bias = _mm_set1_epi16((short)0x8000);
+  uint16_t u[8];
+
+  for (; i + 8 <= n; i += 8) {   // Eight bin numbers at a time
+    _mm_storeu_si128((__m128i *)u, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(w + i)), bias));
+    h[u[0]]++; h[NP08_CAL_BINS + u[1]]++; h[2 * NP08_CAL_BINS + u[2]]++; h[3 * NP08_CAL_BINS + u[3]]++;
+    h[u[4]]++; h[NP08_CAL_BINS + u[5]]++; h[2 * NP08_CAL_BINS + u[6]]++; h[3 * NP08_CAL_BINS + u[7]]++;
+  }
+#endif
+  for (; i < n; i++) h[(i & 3) * NP08_CAL_BINS + (uint16_t)(w[i] + 32768)]++;
+}
+
+// ADC count below which the fraction frac of the cnt entries of h lie.  The entries of a bin are spread evenly over the
+// q ADC counts around it, q being the step of the digitiser (256 for 8 bit data) or 1 for filtered data
+double NP08HistQuantile(const uint32_t * h, double cnt, double frac, int32_t q)
+{
+  double target = frac * cnt, cum = 0.;
+  int32_t v;
+
+  for (v = 0; v < NP08_CAL_BINS; v++) {
+    if (h[v] == 0) continue;
+    if (cum + h[v] >= target) return v - 32768 - 0.5 * q + q * (target - cum) / h[v];
+    cum += h[v];
+  }
+  return 32767.;
+}
+
+void NP08Calibrate(UNIT * unit, NP08VARS * np08)
+{
+  uint32_t * h;
+  uint32_t capture, nCaptures = np08->nCaptures, nSegments = np08->nSegments;
+  PS5000A_CHANNEL trigChannel = np08->trigChannel;
+  PS5000A_THRESHOLD_DIRECTION trigDirection = np08->trigDirection;
+  int16_t trigThreshold = np08->trigThreshold, trigAuto_ms = np08->trigAuto_ms;
+  int16_t thr[4], pthr[4];   // The proposed thresholds, and as np08->peakThreshold[] holds them
+  int32_t j, k, q, stop, range, trig = -1;
+  double ped, sigma, mv;
+  char ch;
+
+  for (j = 0; j < unit->channelCount && j < 4; j++) {
+    if (unit->channelSettings[j].enabled) break;
+  }
+  if (j >= unit->channelCount || j >= 4) { printf("No channels are enabled\n"); return; }
+  h = (uint32_t*)calloc(4 * NP08_CAL_BINS, sizeof(uint32_t));
+  if (h == NULL) { printf("Not enough memory for the histograms\n"); return; }
+
+  printf("Taking %d auto triggered captures to measure the noise...\n", np08->calCaptures);
+  np08->trigChannel = (PS5000A_CHANNEL)(PS5000A_CHANNEL_A + j);
+  np08->trigThreshold = unit->maxADCValue;     // Never reached, so each capture comes from the auto trigger
+  np08->trigDirection = PS5000A_RISING;
+  np08->trigAuto_ms = 1;
+  np08->nCaptures = np08->calCaptures;
+  np08->nSegments = 4 * np08->nCaptures;
+  stop = NP08CollectRapidBlock(unit, np08, 0, 0);
+  np08->trigChannel = trigChannel;
+  np08->trigThreshold = trigThreshold;
+  np08->trigDirection = trigDirection;
+  np08->trigAuto_ms = trigAuto_ms;
+  np08->nCaptures = nCaptures;
+  np08->nSegments = nSegments;
+  if (stop || !np08->isMemAllocated || np08->statusBulk != PICO_OK || np08->nCapturesM == 0) {
+    printf("No data, thresholds not changed\n");
+    free(h);
+    return;
+  }
+
+  switch (unit->resolution) {    // ADC counts per step of the digitiser
+  case PS5000A_DR_8BIT:  q = 256; break;
+  case PS5000A_DR_12BIT: q = 16; break;
+  case PS5000A_DR_14BIT: q = 4; break;
+  case PS5000A_DR_15BIT: q = 2; break;
+  default:               q = 1; break;
+  }
+
+  for (j = 0; j < unit->channelCount && j < 4; j++) {
+    thr[j] = pthr[j] = np08->peakThreshold[j];
+    if (!unit->channelSettings[j].enabled) continue;
+    memset(h, 0, 4 * NP08_CAL_BINS * sizeof(uint32_t));
+    for (capture = 0; capture < np08->nCapturesM; capture++) NP08HistFill(h, np08->rapidBuffers[j][capture], np08->nSamplesM);
+    for (k = 0; k < NP08_CAL_BINS; k++) h[k] += h[NP08_CAL_BINS + k] + h[2 * NP08_CAL_BINS + k] + h[3 * NP08_CAL_BINS + k];
+
+    ped = NP08HistQuantile(h, (double)np08->nCapturesM * np08->nSamplesM, 0.5, (np08->filterType[j] == 0) ? q : 1);
+    sigma = NP08HistQuantile(h, (double)np08->nCapturesM * np08->nSamplesM, 0.8413, (np08->filterType[j] == 0) ? q : 1) - ped;
+    k = (int32_t)lrint(ped - np08->calSigma * sigma);
+    if (k >= ped) k = (int32_t)floor(ped) - 1;
+    thr[j] = pthr[j] = (int16_t)((k < -32768) ? -32768 : k);
+    if (np08->baseMode == 2) {   // Relative to the pedestal, otherwise it would be counted twice
+      k = (int32_t)lrint(-np08->calSigma * sigma);
+      if (k >= 0) k = -1;
+      pthr[j] = (int16_t)((k < -32768) ? -32768 : k);
+    }
+    range = unit->channelSettings[PS5000A_CHANNEL_A + j].range;
+    mv = (double)inputRanges[range] / unit->maxADCValue;   // mV per ADC count, as in adc_to_mv()
+    printf(" %c pedestal %.1f (%.2fmV), noise %.2f (%.3fmV), threshold %d (%dmV) proposed %d (%dmV)%s%s\n", j + 'A', ped, ped * mv,
+	   sigma, sigma * mv, np08->peakThreshold[j], adc_to_mv(np08->peakThreshold[j], range, unit), pthr[j], adc_to_mv(pthr[j], range, unit),
+	   (np08->baseMode == 2) ? " from the pedestal" : "", (np08->filterType[j] != 0) ? " after the filter" : "");
+    if (j == (int32_t)trigChannel && np08->filterType[j] == 0) trig = j;   // The trigger sees the unfiltered signal
+  }
+  free(h);
+  if (trig >= 0) {
+    printf(" Trigger threshold %d (%dmV) proposed %d (%dmV)\n", np08->trigThreshold, adc_to_mv(np08->trigThreshold, unit->channelSettings[trig].range, unit),
+	   thr[trig], adc_to_mv(thr[trig], unit->channelSettings[trig].range, unit));
+  }
+
+  printf("Use the proposed thresholds? (Y/N):");
+  fflush(stdin);
+  ch = toupper(_getch());
+  printf("\n");
+  if (ch != 'Y') return;
+  for (j = 0; j < unit->channelCount && j < 4; j++) np08->peakThreshold[j] = pthr[j];
+  if (trig >= 0) np08->trigThreshold = thr[trig];
+}
+
+/****************************************************************************
+* NP08BenchKernels
+*  Times the pulse finding of NP08PeakFind5 on the captures last collected,
+*  with the generic code and with the kernel compiled for the current channel
+*  setup (see NP08FindBody), and checks they find the same pulses.
+****************************************************************************/
+void NP08BenchKernels(UNIT * unit, NP08VARS * np08)
+{
+  NP08FINDKERNEL kernel = NP08PickKernel(unit);
+  NP08EVENT ev1, ev2;
+  uint32_t capture;
+  int32_t rep, nrep = 20, j, bad = 0, badBatch = 0;
+  int64_t t0, t1, t2, t3, t4;
+
+  if (!np08->isMemAllocated) { printf("No data collected\n"); return; }
+  memset(&ev1, 0, sizeof(ev1));
+  memset(&ev2, 0, sizeof(ev2));
+
+  for (capture = 0; capture < np08->nCapturesM; capture++) {
+    NP08FindGeneric(unit, np08, capture, &ev1);
+    kernel(unit, np08, capture, &ev2);
+    for (j = 0; j < 4; j++) {
+      if (ev1.ok[j] != ev2.ok[j] || ev1.index[j] != ev2.index[j] || ev1.height[j] != ev2.height[j] || ev1.interp[j] != ev2.interp[j]) bad++;
+    }
+    if (ev1.nex != ev2.nex) bad++;
+    for (j = 1; j <= ev1.nex && j <= ev2.nex; j++) {
+      if (ev1.ex_ok[j] != ev2.ex_ok[j] || ev1.ex_index[j] != ev2.ex_index[j] || ev1.ex_hb[j] != ev2.ex_hb[j] || ev1.ex_endindex[j] != ev2.ex_endindex[j]) bad++;
+    }
+  }
+
+  t0 = GetTime_MicroSecond();
+  for (rep = 0; rep < nrep; rep++) {
+    for (capture = 0; capture < np08->nCapturesM; capture++) NP08FindGeneric(unit, np08, capture, &ev1);
+  }
+  t1 = GetTime_MicroSecond();
+  for (rep = 0; rep < nrep; rep++) {
+    for (capture = 0; capture < np08->nCapturesM; capture++) kernel(unit, np08, capture, &ev2);
+  }
+  t2 = GetTime_MicroSecond();
+
+  // The same with the pulses found a block of captures at a time
+  for (capture = 0; capture < np08->nCapturesM; capture++) {
+    if (capture % NP08_BATCH == 0) NP08BatchExtract(unit, np08, capture);
+    NP08FindGeneric(unit, np08, capture, &ev1);
+    np08->batchFirst = -1;
+    NP08FindGeneric(unit, np08, capture, &ev2);
+    np08->batchFirst = capture - capture % NP08_BATCH;
+    if (memcmp(ev1.ok, ev2.ok, sizeof(ev1.ok)) || memcmp(ev1.index, ev2.index, sizeof(ev1.index)) || memcmp(ev1.interp, ev2.interp, sizeof(ev1.interp)) ||
+	memcmp(ev1.height, ev2.height, sizeof(ev1.height)) || memcmp(ev1.base, ev2.base, sizeof(ev1.base)) || ev1.nex != ev2.nex ||
+	memcmp(ev1.ex_index, ev2.ex_index, (ev1.nex + 1) * sizeof(int)) || memcmp(ev1.ex_endindex, ev2.ex_endindex, (ev1.nex + 1) * sizeof(int))) badBatch++;
+  }
+  t3 = GetTime_MicroSecond();
+  for (rep = 0; rep < nrep; rep++) {
+    for (capture = 0; capture < np08->nCapturesM; capture++) {
+      if (capture % NP08_BATCH == 0) NP08BatchExtract(unit, np08, capture);
+      kernel(unit, np08, capture, &ev2);
+    }
+  }
+  t4 = GetTime_MicroSecond();
+  np08->batchFirst = -1;
+
+  printf("Pulse finding on %d captures of %d samples, %s kernel for this channel setup\n", np08->nCapturesM, np08->nSamples,
+	 (kernel == NP08FindGeneric) ? "no special" : "special");
+  printf("  generic  %8.3f ms per group\n", (double)(t1 - t0) / 1000. / nrep);
+  printf("  special  %8.3f ms per group\n", (double)(t2 - t1) / 1000. / nrep);
+  printf("  batch    %8.3f ms per group (special, %d captures at a time)\n", (double)(t4 - t3) / 1000. / nrep, NP08_BATCH);
+  printf("  %d differences, %d with the batch\n", bad, badBatch);
+
+  // The leading edge search on the packed samples against the int16 one
+  if (np08->packMask) {
+    NP08PULSE pulses1[NP08_MAX_PULSES], pulses2[NP08_MAX_PULSES];
+    int32_t n1, n2, badPack = 0;
+
+    for (capture = 0; capture < np08->nCapturesM; capture++) {
+      for (j = 0; j < 4; j++) {
+	if (!(np08->packMask & (1 << j))) continue;
+	n1 = NP08ExtractPulses(np08->rapidBuffers[j][capture], np08->nSamples, NP08Threshold(np08, j), pulses1);
+	n2 = NP08ExtractPulses8(np08->packBuffers[j][capture], np08->rapidBuffers[j][capture], np08->nSamples, NP08Threshold(np08, j), pulses2);
+	if (n1 != n2 || memcmp(pulses1, pulses2, n1 * sizeof(NP08PULSE))) badPack++;
+      }
+    }
+    t0 = GetTime_MicroSecond();
+    for (rep = 0; rep < nrep; rep++) {
+      for (capture = 0; capture < np08->nCapturesM; capture++) {
+	for (j = 0; j < 4; j++) {
+	  if (np08->packMask & (1 << j)) NP08ExtractPulses(np08->rapidBuffers[j][capture], np08->nSamples, NP08Threshold(np08, j), pulses1);
+	}
+      }
+    }
+    t1 = GetTime_MicroSecond();
+    for (rep = 0; rep < nrep; rep++) {
+      for (capture = 0; capture < np08->nCapturesM; capture++) {
+	for (j = 0; j < 4; j++) {
+	  if (np08->packMask & (1 << j)) NP08ExtractPulses8(np08->packBuffers[j][capture], np08->rapidBuffers[j][capture], np08->nSamples, NP08Threshold(np08, j), pulses2);
+	}
+      }
+    }
+    t2 = GetTime_MicroSecond();
+    printf("Pulse lists of the packed channels: int16 %.3f ms, packed %.3f ms per group, %d differences\n",
+	   (double)(t1 - t0) / 1000. / nrep, (double)(t2 - t1) / 1000. / nrep, badPack);
+  }
+
+  // Cost of the pile-up search, per pulse on the second channel
+  if (np08->secondChan >= 0 && np08->secondChan < unit->channelCount && unit->channelSettings[np08->secondChan].enabled) {
+    NP08PULSE pulses[NP08_MAX_PULSES], first, second;
+    int32_t nPulses, ip, nFound = 0, nTotal = 0;
+    int32_t dip = (np08->pileDip > 0) ? np08->pileDip : 200;
+
+    NP08PileShape(np08->pileShape, np08->pileRise);
+    t0 = 0;
+    for (capture = 0; capture < np08->nCapturesM; capture++) {
+      nPulses = NP08ExtractPulses(np08->rapidBuffers[np08->secondChan][capture], np08->nSamples, NP08Threshold(np08, np08->secondChan), pulses);
+      t1 = GetTime_MicroSecond();
+      for (rep = 0; rep < nrep; rep++) {
+	for (ip = 0; ip < nPulses; ip++) {
+	  nFound += NP08SplitPileup(np08->rapidBuffers[np08->secondChan][capture], np08->nSamples, NP08Threshold(np08, np08->secondChan), &pulses[ip], dip,
+				    np08->pileShape, np08->pileRise, &first, &second);
+	}
+      }
+      t0 += GetTime_MicroSecond() - t1;
+      nTotal += nPulses * nrep;
+    }
+    printf("Pile-up search (dip %d): %d pulses, %d piled up, %.3f us per pulse\n", dip, nTotal / nrep, nFound / nrep,
+	   (nTotal > 0) ? (double)t0 / nTotal : 0.);
+  }
+
+  // Cost of the template fit, per main pulse on the channels with a template
+  if (np08->fitLearn > 0) {
+    int32_t nFit = 0, nTotal = 0;
+    t0 = 0;
+    for (capture = 0; capture < np08->nCapturesM; capture++) {
+      kernel(unit, np08, capture, &ev2);
+      t1 = GetTime_MicroSecond();
+      for (rep = 0; rep < nrep; rep++) {
+	for (j = 0; j < unit->channelCount && j < 4; j++) {
+	  if (!ev2.ok[j] || !np08->fitTemplate[j].ready) continue;
+	  nFit += NP08FitPulse(&np08->fitTemplate[j], np08->rapidBuffers[j][capture], np08->nSamples, ev2.index[j], ev2.base[j], ev2.height[j],
+			       &ev2.fitAmp[j], &ev2.fitTime[j], &ev2.fitChi2[j]);
+	  nTotal++;
+	}
+      }
+      t0 += GetTime_MicroSecond() - t1;
+    }
+    printf("Template fit: %d pulses, %d fitted, %.3f us per pulse\n", nTotal / nrep, nFit / nrep, (nTotal > 0) ? (double)t0 / nTotal : 0.);
+  }
+}
+
+/****************************************************************************
+* NP08ExtraMenu
+*  Extra functions and their settings, which are not needed for the normal
+*  NP08 data taking
+****************************************************************************/
+void NP08ExtraMenu(UNIT * unit, NP08VARS * np08)
+{
+  int8_t ch = '.';
+
+  while (ch != 'X') {
+    printf("\nNP08 extra function menu:\n");
+    printf(" H Health monitor (downsampled streaming to runM_XXXXXX.dat)\n");
+    printf(" R Health monitor downsampling ratio %d (samples per bin)\n", np08->monitorDownsample);
+    printf(" T Health monitor interval %d s\n", np08->monitorInterval_s);
+    printf(" K Time the peak finding kernels on the last captures\n");
+    printf(" B Find the pulses of %d captures together: %s\n", NP08_BATCH, np08->batchMode ? "on" : "off");
+    printf(" P Pack the samples to 8 bits in 8-bit mode: %s\n", np08->packMode ? "on" : "off");
+    if (np08->zsMode) printf(" Z Zero-suppressed waveforms to runD_XXXXXX_zs.dat, %d ticks before and %d after each pulse\n", np08->zsPre, np08->zsPost);
+    else printf(" Z Zero-suppressed waveforms off\n");
+    printf(" F Columnar copy of the records to runD_XXXXXX_col.dat: %s\n", np08->colMode ? "on" : "off");
+    printf(" A Arrow (Feather) copy of the records to runD_XXXXXX.feather: %s\n", np08->arrowMode ? "on" : "off");
+    printf(" I Index of the groups in the run file to runD_XXXXXX.idx: %s\n", np08->idxMode ? "on" : "off");
+    printf(" C Calibrate the thresholds from the noise (%d sigma, %d captures)\n", np08->calSigma, np08->calCaptures);
+    printf(" S Set the calibration sigma and captures\n");
+    printf(" X Exit back to main menu\n");
+
+    fflush(stdin);
+    ch = toupper(_getch());
+    printf("\n");
+
+    switch (ch) {
+    case 'H':
+      NP08StreamMonitor(unit, np08);
+      break;
+
+    case 'K':
+      NP08BenchKernels(unit, np08);
+      break;
+
+    case 'C':
+      NP08Calibrate(unit, np08);
+      break;
+
+    case 'B':
+      np08->batchMode = !np08->batchMode;
+      break;
+
+    case 'P':
+      np08->packMode = !np08->packMode;
+      if (!np08->packMode) NP08PackFree(unit, np08);   // Straight away for the captures already collected
+      break;
+
+    case 'F':
+      np08->colMode = !np08->colMode;
+      break;
+
+    case 'A':
+      np08->arrowMode = !np08->arrowMode;
+      break;
+
+    case 'I':
+      np08->idxMode = !np08->idxMode;
+      break;
+
+    case 'Z':
+      do {
+	printf("Give 1 to write the zero-suppressed waveforms in the loop, 0 for off [0..1]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->zsMode);
+      } while (np08->zsMode < 0 || np08->zsMode > 1);
+      if (!np08->zsMode) break;
+      do {
+	printf("Give the ticks kept before each crossing [0..1000]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->zsPre);
+      } while (np08->zsPre < 0 || np08->zsPre > 1000);
+      do {
+	printf("Give the ticks kept after each pulse ends [0..1000]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->zsPost);
+      } while (np08->zsPost < 0 || np08->zsPost > 1000);
+      break;
+
+    case 'S':
+      do {
+	printf("Give the number of noise sigma below the pedestal for the thresholds [1..100]:");
+	fflush(stdin);
+	scanf_s("%d", &np08->calSigma);
+      } while (np08->calSigma < 1 || np08->calSigma > 100);
+      do {
+	printf("Give the number of captures to measure the noise on [1..1000]:");
+	fflush(stdin);
+	scanf_s("%u", &np08->calCaptures);
+      } while (np08->calCaptures < 1 || np08->calCaptures > 1000);
+      break;
+
+    case 'R':
+      do {
+	printf("Give number of samples per monitor bin [1..65536]:");
+	fflush(stdin);
+	scanf_s("%u", &np08->monitorDownsample);
+      } while (np08->monitorDownsample < 1 || np08->monitorDownsample > 65536);
+      break;
+
+    case 'T':
+      do {
+	printf("Give number of seconds per monitor line [1..86400]:");
+	fflush(stdin);
+	scanf_s("%u", &np08->monitorInterval_s);
+      } while (np08->monitorInterval_s < 1 || np08->monitorInterval_s > 86400);
+      break;
+
+    case 'X':
+      break;
+
+    default:
+      break;
+    }
+  }
+}
+
 /****************************************************************************
 * NP08Menu
 * Controls most common functions of the selected unit of the NP08 practical
@@ -4016,7 +8155,10 @@ void NP08Menu(UNIT* unit) {
   np08->rapidBuffers = NULL;
   np08->overflow = NULL;
   np08->triggerInfo = NULL;
+  np08->packBuffers = NULL;
   np08->triggerTimeLast = 0;  // From last capture (since there isn' one, 0 is the best we can do).
+  np08->stitchFirst = 0;
+  np08->stitchCount = 0;
   np08->isMemAllocated = 0;   // 0 = not allocated, 1 = they have been calloc/malloced
   np08->nCapturesM = np08->nCaptures;  // Number of captures received (smaller if key pressed)
   np08->nSamplesM = np08->nSamples;    // Number received, not sure how this can be different from desired?
@@ -4032,7 +8174,7 @@ void NP08Menu(UNIT* unit) {
     printf("C - Collect set of Rapid captures   D - Set resolution\n");
     printf("O - Output from rapid captures      I - Set timebase\n");
     printf("L - Loop for long run to disk       V - Set voltage ranges\n");
-    printf("E - Extra function menu (none yet)  S - Set NP08 trigger and peak finding\n");
+    printf("E - Extra function menu             S - Set NP08 trigger and peak finding\n");
     printf("M - Picoscope SDK example Menu      X - Exit\n");
     printf("Operation:");
 
@@ -4078,6 +8220,10 @@ void NP08Menu(UNIT* unit) {
       setNP08Things(unit,np08);
       break;
 
+    case 'E':
+      NP08ExtraMenu(unit,np08);
+      break;
+
     case 'V':
       setVoltages(unit);
       break;
@@ -4101,7 +8247,10 @@ void NP08Menu(UNIT* unit) {
 #endif
 
 	case 'O':
+		np08->stitchCount = 0;
+		np08->triggerTimeLast = 0;
 		NP08PeakFind5(unit, np08, stdout);
+		NP08StitchRelease(unit, np08, stdout, 0, 1);
 		break;
 
     case 'X':